@@ -0,0 +1,50 @@
+#pragma once
+
+/*
+ * The messages the calculator clients send to the server and how the
+ * server prints the results, shared by message_queue.c and shm_queue.c.
+ */
+
+/*
+ * The commands supported by the server
+ */
+typedef enum _Command {
+    CmdAdd = 0x00,     // Adds the two message parameters
+    CmdSubtract,       // Subtracts the two message parameters
+    CmdExit            // Stops the server
+} Command;
+
+/*
+ * The message format to be sent to the server.
+ */
+typedef struct _Message {
+    /*
+     * One of the command constants.
+     */
+    Command command;
+    /*
+     * Used as operand 1 (if required)
+     */
+    int parameter1;
+    /*
+     * Used as operand 2 (if required)
+     */
+    int parameter2;
+    /*
+     * Identifies the sending client. The results of one client are printed
+     * in the order its messages were sent, also with several workers.
+     */
+    int client;
+    /*
+     * Sent back with the result, -1 if the client wants no reply.
+     */
+    int requestId;
+    /*
+     * Tells apart the reply queues a client ID had over time: a client
+     * that stops and starts again reuses its descriptor, and so its ID.
+     */
+    unsigned generation;
+} Message;
+
+#define FORMAT_STRING_ADD      "Calc: %d + %d = %d\n"
+#define FORMAT_STRING_SUBTRACT "Calc: %d - %d = %d\n"
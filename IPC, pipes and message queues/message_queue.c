@@ -1,40 +1,194 @@
 #include "message_queue.h"
+#include "message_queue_ext.h"
+#include "calculator.h"
 #include <fcntl.h>           /* For O_* constants ->file control options */
 #include <sys/stat.h>        /* For mode constants */
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
 /*
- * The commands supported by the server
+ * The reply to a request, sent to the reply queue of the client.
  */
-typedef enum _Command {
-    CmdAdd = 0x00,     // Adds the two message parameters
-    CmdSubtract,       // Subtracts the two message parameters
-    CmdExit            // Stops the server
-} Command;
+typedef struct _Reply {
+    int requestId;
+    int result;
+} Reply;
+
+#define QUEUE_NAME "/simple_calculator"
+
+/*
+ * A queue message carries up to MAX_BATCH_MESSAGES messages back to back.
+ * 8192 bytes is the default limit for mq_msgsize (fs.mqueue.msgsize_max).
+ */
+#define MAX_BATCH_BYTES    8192
+#define MAX_BATCH_MESSAGES (MAX_BATCH_BYTES / sizeof(Message))
 
 /*
- * The message format to be sent to the server.
+ * Client descriptors that can queue messages or have a reply channel
  */
-typedef struct _Message {
+#define MAX_CLIENTS 1024
+
+/*
+ * Messages queued for a client and not yet sent. Threads sharing a client
+ * share its batch, so a thread waiting for a result also sends the
+ * requests other threads queued. The lock is held while the batch is sent,
+ * which keeps the messages in order.
+ */
+typedef struct _Batch {
+    pthread_mutex_t lock;
     /*
-     * One of the command constants.
+     * The number of messages that fit in one queue message of the client,
+     * 0 if not known yet.
      */
-    Command command;
+    size_t capacity;
+    size_t count;
+    Message messages[MAX_BATCH_MESSAGES];
+} Batch;
+
+/*
+ * Every client that sends requests gets a reply queue of its own, named
+ * after its client ID and the generation of the queue. Replies are packed like messages, up to REPLY_BATCH
+ * in one queue message. A client can have at most MAX_OUTSTANDING_REQUESTS
+ * requests whose result it did not collect yet, so the server can buffer
+ * all replies that do not fit in a full reply queue and never has to wait
+ * for a client.
+ */
+#define REPLY_QUEUE_FORMAT "/simple_calculator_reply_%u_%u"
+#define REPLY_BATCH        256
+#define REPLY_QUEUE_LENGTH 10
+#define MAX_OUTSTANDING_REQUESTS (4 * REPLY_BATCH)
+// Reply queues the server (or each worker) keeps open
+#define REPLY_CACHE_SIZE   64
+// How long the server waits before sending to a full reply queue again
+#define REPLY_RETRY_NANOS  1000000
+// Retries at shutdown before the replies to a full reply queue are dropped
+#define REPLY_CLOSE_RETRIES 1000
+// How long receiveResult waits for a result before it fails with ETIMEDOUT
+#define REPLY_TIMEOUT_SECONDS 10
+
+/*
+ * The client side of a reply queue. Threads sharing a client share it, so
+ * the fields below queue are protected by lock.
+ */
+typedef struct _ReplyChannel {
+    mqd_t queue;
+    unsigned generation;
+    pthread_mutex_t lock;
+    /*
+     * Set while a thread receives from the queue, the others wait for
+     * arrived instead of taking its replies from under it. Requests queued
+     * meanwhile are sent right away, see _sendRequest.
+     */
+    int receiving;
+    pthread_cond_t arrived;
+    int nextRequestId;
     /*
-     * Used as operand 1 (if required)
+     * Requests whose result was not handed out by receiveResult yet.
      */
-    int parameter1;
+    size_t outstanding;
     /*
-     * Used as operand 2 (if required)
+     * Received replies not handed out yet, a ring starting at next.
      */
-    int parameter2;
-} Message;
+    size_t next;
+    size_t count;
+    Reply replies[MAX_OUTSTANDING_REQUESTS];
+} ReplyChannel;
 
-#define QUEUE_NAME "/simple_calculator"
-#define FORMAT_STRING_ADD      "Calc: %d + %d = %d\n"
-#define FORMAT_STRING_SUBTRACT "Calc: %d - %d = %d\n"
+/*
+ * The server side of a reply queue, with the replies not sent yet. The
+ * queue is -1 while it is closed: a target keeps its replies when its
+ * queue is closed to make room for the queue of another client.
+ */
+typedef struct _ReplyTarget {
+    int used;
+    int client;
+    unsigned generation;
+    mqd_t queue;
+    size_t count;
+    Reply replies[MAX_OUTSTANDING_REQUESTS];
+} ReplyTarget;
+
+/*
+ * The reply targets of the server (or a worker): one for every client with
+ * buffered replies, so no reply is dropped for lack of a target, and at
+ * most REPLY_CACHE_SIZE of them have their queue open.
+ */
+typedef struct _ReplyCache {
+    ReplyTarget **targets;
+    size_t targetCount;
+    size_t targetCapacity;
+    size_t openQueues;
+    /*
+     * The target found last, and where to look for a queue to close.
+     */
+    size_t last;
+    size_t nextVictim;
+    /*
+     * Replies buffered in all targets.
+     */
+    size_t unsent;
+} ReplyCache;
+
+static Batch *_batches[MAX_CLIENTS];
+static ReplyChannel *_channels[MAX_CLIENTS];
+// The generation of the last reply queue this process created
+static unsigned _channelGeneration;
+// Protects _batches and _channels
+static pthread_mutex_t _clientLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * With worker threads, the server hands the messages of a client to the
+ * worker client % workerCount. Each worker has a bounded queue and formats
+ * its results into an output buffer that is written out in one go when
+ * full or when the worker runs out of messages.
+ */
+#define MAX_WORKERS        64
+#define WORKER_QUEUE_SIZE  4096
+#define OUTPUT_BUFFER_SIZE 65536
+// Longest line the format strings can produce
+#define MAX_LINE_LENGTH    64
+
+typedef struct _Worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    /*
+     * Ring of queued messages, protected by lock.
+     */
+    Message queue[WORKER_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+    /*
+     * Set once CmdExit arrived: finish the queue, then stop.
+     */
+    int closing;
+    /*
+     * Formatted results not written yet, only used by the worker.
+     */
+    char output[OUTPUT_BUFFER_SIZE];
+    size_t outputUsed;
+    /*
+     * Reply queues of the clients of this worker. Like the output, replies
+     * are sent when the worker runs idle.
+     */
+    ReplyCache replies;
+} Worker;
+
+static pthread_mutex_t _outputLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Identifies this client in its messages: the process and the descriptor.
+ */
+static int _clientId(mqd_t client)
+{
+    return (int)((unsigned)getpid() * MAX_WORKERS * 16u + (unsigned)client);
+}
 
 mqd_t startClient(void)
 {
@@ -43,11 +197,338 @@ mqd_t startClient(void)
     return q_client;
 }
 
+/*
+ * The time seconds and nanos from now, for timed waits.
+ */
+static struct timespec _deadline(time_t seconds, long nanos)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += seconds;
+    deadline.tv_nsec += nanos;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+/*
+ * Return the batch of a client, creating it on first use. Return NULL on
+ * error.
+ */
+static Batch *_getBatch(mqd_t client)
+{
+    if ((client < 0) || (client >= MAX_CLIENTS)) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&_clientLock);
+    Batch *batch = _batches[client];
+    if (batch == NULL) {
+        batch = calloc(1, sizeof(Batch));
+        if (batch != NULL) {
+            pthread_mutex_init(&batch->lock, NULL);
+            __atomic_store_n(&_batches[client], batch, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&_clientLock);
+    return batch;
+}
+
+/*
+ * Send the messages of a batch in as few queue messages as the queue's
+ * mq_msgsize allows. The batch must be locked.
+ */
+static int _flushBatch(mqd_t client, Batch *batch)
+{
+    size_t sent = 0;
+    while (sent < batch->count) {
+        size_t count = batch->count - sent;
+        if (count > batch->capacity) {
+            count = batch->capacity;
+        }
+        if (mq_send(client, (char*) &batch->messages[sent], count * sizeof(Message), 0) != 0) {
+            // Keep what was not sent, so the caller can retry.
+            memmove(batch->messages, &batch->messages[sent], (batch->count - sent) * sizeof(Message));
+            batch->count -= sent;
+            return -1;
+        }
+        sent += count;
+    }
+    batch->count = 0;
+    return 0;
+}
+
+/*
+ * Send all messages queued for the client, by any thread.
+ */
+int flushTasks(mqd_t client)
+{
+    if ((client < 0) || (client >= MAX_CLIENTS)) {
+        return 0;
+    }
+    Batch *batch = __atomic_load_n(&_batches[client], __ATOMIC_ACQUIRE);
+    if (batch == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    int result = _flushBatch(client, batch);
+    pthread_mutex_unlock(&batch->lock);
+    return result;
+}
+
+/*
+ * Queue a message in the batch of the client, sending the batch first if
+ * it is full. The batch must be locked.
+ */
+static int _queueMessage(mqd_t client, Batch *batch, Command command, int operand1, int operand2,
+                         int requestId, unsigned generation)
+{
+    if (batch->capacity == 0) {
+        struct mq_attr attr;
+        if (mq_getattr(client, &attr) != 0) {
+            return -1;
+        }
+        batch->capacity = (size_t)attr.mq_msgsize / sizeof(Message);
+        if (batch->capacity > MAX_BATCH_MESSAGES) {
+            batch->capacity = MAX_BATCH_MESSAGES;
+        }
+        if (batch->capacity == 0) {
+            return -1;
+        }
+    }
+    if ((batch->count >= batch->capacity) && (_flushBatch(client, batch) != 0)) {
+        return -1;
+    }
+
+    Message *msg = &batch->messages[batch->count++];
+    msg->command    = command;
+    msg->parameter1 = operand1;
+    msg->parameter2 = operand2;
+    msg->client     = _clientId(client);
+    msg->requestId  = requestId;
+    msg->generation = generation;
+    return 0;
+}
+
+static int _queueTask(mqd_t client, Command command, int operand1, int operand2)
+{
+    Batch *batch = _getBatch(client);
+    if (batch == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    int result = _queueMessage(client, batch, command, operand1, operand2, -1, 0);
+    pthread_mutex_unlock(&batch->lock);
+    return result;
+}
+
+/*
+ * Like sendAddTask, but the message is only sent with the next flushTasks
+ * (or once a queue message is full). Messages of one thread keep their
+ * order, also relative to the send*Task functions.
+ */
+int queueAddTask(mqd_t client, int operand1, int operand2)
+{
+    return _queueTask(client, CmdAdd, operand1, operand2);
+}
+
+int queueSubtractTask(mqd_t client, int operand1, int operand2)
+{
+    return _queueTask(client, CmdSubtract, operand1, operand2);
+}
+
+/*
+ * Return the reply channel of a client, creating its reply queue on first
+ * use. Return NULL on error.
+ */
+static ReplyChannel *_getChannel(mqd_t client)
+{
+    if ((client < 0) || (client >= MAX_CLIENTS)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&_clientLock);
+    ReplyChannel *channel = _channels[client];
+    if (channel == NULL) {
+        channel = calloc(1, sizeof(ReplyChannel));
+        if (channel != NULL) {
+            channel->generation = ++_channelGeneration;
+
+            char name[64];
+            snprintf(name, sizeof(name), REPLY_QUEUE_FORMAT, (unsigned)_clientId(client), channel->generation);
+
+            struct mq_attr attr;
+            attr.mq_flags   = 0;
+            attr.mq_maxmsg  = REPLY_QUEUE_LENGTH;
+            attr.mq_msgsize = REPLY_BATCH * sizeof(Reply);
+            attr.mq_curmsgs = 0;
+
+            // A queue left over by an earlier process with the same ID is stale.
+            mq_unlink(name);
+            channel->queue = mq_open(name, O_CREAT | O_EXCL | O_RDONLY, S_IRUSR | S_IWUSR | S_IWGRP | S_IWOTH, &attr);
+            if (channel->queue == -1) {
+                free(channel);
+                channel = NULL;
+            } else {
+                pthread_mutex_init(&channel->lock, NULL);
+                pthread_cond_init(&channel->arrived, NULL);
+                _channels[client] = channel;
+            }
+        }
+    }
+    pthread_mutex_unlock(&_clientLock);
+    return channel;
+}
+
+/*
+ * Queue a request and take a request ID for it. The batch is locked before
+ * the channel, so requests are queued in the order of their IDs, and the
+ * channel is not locked while the batch is sent.
+ */
+static int _sendRequest(mqd_t client, Command command, int operand1, int operand2)
+{
+    ReplyChannel *channel = _getChannel(client);
+    Batch *batch = _getBatch(client);
+    if ((channel == NULL) || (batch == NULL)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    pthread_mutex_lock(&channel->lock);
+    if (channel->outstanding == MAX_OUTSTANDING_REQUESTS) {
+        pthread_mutex_unlock(&channel->lock);
+        pthread_mutex_unlock(&batch->lock);
+        errno = EAGAIN;
+        return -1;
+    }
+    const int requestId = channel->nextRequestId;
+    const int receiving = channel->receiving;
+    channel->nextRequestId = (requestId == 0x7fffffff) ? 0 : requestId + 1;
+    channel->outstanding++;
+    pthread_mutex_unlock(&channel->lock);
+
+    if (_queueMessage(client, batch, command, operand1, operand2, requestId, channel->generation) != 0) {
+        // Since the batch is locked, no other request took an ID meanwhile.
+        pthread_mutex_lock(&channel->lock);
+        channel->nextRequestId = requestId;
+        channel->outstanding--;
+        pthread_mutex_unlock(&channel->lock);
+        pthread_mutex_unlock(&batch->lock);
+        return -1;
+    }
+    if (receiving) {
+        // A thread waits for results and may be waiting for this one. If
+        // sending fails, the request stays queued for the next flush.
+        _flushBatch(client, batch);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return requestId;
+}
+
+/*
+ * Like queueAddTask, but the server also sends the result back. Return the
+ * request ID that receiveResult reports with the result, or -1 on error.
+ * Requests are sent with the next flushTasks, or by receiveResult, so many
+ * can be in flight at a time, but at most MAX_OUTSTANDING_REQUESTS: beyond
+ * that -1 is returned with errno EAGAIN until results were received.
+ */
+int sendAddRequest(mqd_t client, int operand1, int operand2)
+{
+    return _sendRequest(client, CmdAdd, operand1, operand2);
+}
+
+int sendSubtractRequest(mqd_t client, int operand1, int operand2)
+{
+    return _sendRequest(client, CmdSubtract, operand1, operand2);
+}
+
+/*
+ * Wait for the next result of a request of this client. The results of one
+ * client arrive in the order of its requests. Return -1 on error, or if no
+ * request of the client is outstanding. If no result arrives within
+ * REPLY_TIMEOUT_SECONDS, -1 is returned with errno ETIMEDOUT and the
+ * requests stay outstanding. Several threads can wait for the results of a
+ * shared client, each sees the next one that arrived.
+ */
+int receiveResult(mqd_t client, int *requestId, int *result)
+{
+    if ((client < 0) || (client >= MAX_CLIENTS)) {
+        return -1;
+    }
+    ReplyChannel *channel = _channels[client];
+    if (channel == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&channel->lock);
+    while (channel->count == 0) {
+        if (channel->outstanding == 0) {
+            pthread_mutex_unlock(&channel->lock);
+            return -1;
+        }
+        if (channel->receiving) {
+            pthread_cond_wait(&channel->arrived, &channel->lock);
+            continue;
+        }
+        channel->receiving = 1;
+        // Do not hold the lock while waiting, other threads may have to
+        // send the requests this one waits for.
+        pthread_mutex_unlock(&channel->lock);
+
+        // The requests we wait for may still be queued, by any thread.
+        // Requests queued from now on are sent right away.
+        Reply replies[REPLY_BATCH];
+        ssize_t received = -1;
+        if (flushTasks(client) == 0) {
+            const struct timespec deadline = _deadline(REPLY_TIMEOUT_SECONDS, 0);
+            do {
+                received = mq_timedreceive(channel->queue, (char*) replies, sizeof(replies), NULL, &deadline);
+            } while ((received == -1) && (errno == EINTR));
+        }
+        const int error = errno;
+
+        pthread_mutex_lock(&channel->lock);
+        channel->receiving = 0;
+        pthread_cond_broadcast(&channel->arrived);
+        if ((received <= 0) || (received % sizeof(Reply) != 0)) {
+            pthread_mutex_unlock(&channel->lock);
+            errno = error;
+            return -1;
+        }
+
+        // There is room: the ring holds a reply for every outstanding request.
+        for (size_t i = 0; i < received / sizeof(Reply); i++) {
+            channel->replies[(channel->next + channel->count) % MAX_OUTSTANDING_REQUESTS] = replies[i];
+            channel->count++;
+        }
+    }
+
+    *requestId = channel->replies[channel->next].requestId;
+    *result    = channel->replies[channel->next].result;
+    channel->next = (channel->next + 1) % MAX_OUTSTANDING_REQUESTS;
+    channel->count--;
+    channel->outstanding--;
+    pthread_mutex_unlock(&channel->lock);
+    return 0;
+}
+
 int sendExitTask(mqd_t client) // client ~ filedes
 {
+    if (flushTasks(client) != 0) {
+        return -1;
+    }
+
     // Send the exit command to the server.
     Message msg;
     msg.command = CmdExit;
+    msg.client = _clientId(client);
+    msg.requestId = -1;
+    msg.generation = 0;
         //int mq_send(mqd_t mqdes, const char *msg_ptr, size_t msg_len, unsigned int msg_prio);
     int sending_result = mq_send(client, (char*) &msg, sizeof(msg), 0); //?
     return sending_result;
@@ -55,9 +536,16 @@ int sendExitTask(mqd_t client) // client ~ filedes
 
 int sendAddTask(mqd_t client, int operand1, int operand2)
 {
+    if (flushTasks(client) != 0) {
+        return -1;
+    }
+
     // Send the add command with the operands
     Message msg;
     msg.command = CmdAdd;
+    msg.client = _clientId(client);
+    msg.requestId = -1;
+    msg.generation = 0;
     msg.parameter1 = operand1;
     msg.parameter2 = operand2;
     int adding_result = mq_send(client, (char*) &msg, sizeof(msg), 0); 
@@ -66,9 +554,16 @@ int sendAddTask(mqd_t client, int operand1, int operand2)
 
 int sendSubtractTask(mqd_t client, int operand1, int operand2)
 {
+    if (flushTasks(client) != 0) {
+        return -1;
+    }
+
     // Send the sub command with the operands
     Message msg;
     msg.command = CmdSubtract;
+    msg.client = _clientId(client);
+    msg.requestId = -1;
+    msg.generation = 0;
     msg.parameter1 = operand1;
     msg.parameter2 = operand2;
     int subt_result = mq_send(client, (char*) &msg, sizeof(msg), 0); 
@@ -78,15 +573,472 @@ int sendSubtractTask(mqd_t client, int operand1, int operand2)
 int stopClient(mqd_t client)
 {
     (void)client;
-    // Clean up anything on the client-side
+    // Clean up anything on the client-side: send what any thread queued.
+    Batch *batch = NULL;
+    ReplyChannel *channel = NULL;
+    if ((client >= 0) && (client < MAX_CLIENTS)) {
+        pthread_mutex_lock(&_clientLock);
+        batch = _batches[client];
+        channel = _channels[client];
+        _batches[client] = NULL;
+        _channels[client] = NULL;
+        pthread_mutex_unlock(&_clientLock);
+    }
+    int flush_result = 0;
+    if (batch != NULL) {
+        pthread_mutex_lock(&batch->lock);
+        flush_result = _flushBatch(client, batch);
+        pthread_mutex_unlock(&batch->lock);
+        pthread_mutex_destroy(&batch->lock);
+        free(batch);
+    }
     int close_result = mq_close(client);
+
+    // Remove the reply queue.
+    if (channel != NULL) {
+        char name[64];
+        snprintf(name, sizeof(name), REPLY_QUEUE_FORMAT, (unsigned)_clientId(client), channel->generation);
+        mq_close(channel->queue);
+        mq_unlink(name);
+        pthread_mutex_destroy(&channel->lock);
+        pthread_cond_destroy(&channel->arrived);
+        free(channel);
+    }
+
+    if (flush_result != 0) {
+        return -1;
+    }
     return close_result;
 }
 
-int runServer(void)
+/*
+ * The result of a command, 0 for commands without one.
+ */
+static int _compute(const Message *msg)
+{
+    switch (msg->command)
+    {
+        case CmdAdd:
+            return msg->parameter1 + msg->parameter2;
+        case CmdSubtract:
+            return msg->parameter1 - msg->parameter2;
+        default:
+            return 0;
+    }
+}
+
+static void _closeReplyQueue(ReplyCache *cache, ReplyTarget *target)
+{
+    if (target->queue != -1) {
+        mq_close(target->queue);
+        target->queue = -1;
+        cache->openQueues--;
+    }
+}
+
+static void _dropReplies(ReplyCache *cache, ReplyTarget *target)
+{
+    cache->unsent -= target->count;
+    target->count = 0;
+}
+
+static void _releaseReplyTarget(ReplyCache *cache, ReplyTarget *target)
+{
+    _closeReplyQueue(cache, target);
+    _dropReplies(cache, target);
+    target->used = 0;
+}
+
+/*
+ * Make room for one more open reply queue. A target without buffered
+ * replies is released, else the queue of a target with replies is closed
+ * and the replies stay buffered.
+ */
+static void _closeSomeReplyQueue(ReplyCache *cache, const ReplyTarget *keep)
+{
+    ReplyTarget *busy = NULL;
+
+    for (size_t i = 0; i < cache->targetCount; i++) {
+        ReplyTarget *target = cache->targets[(cache->nextVictim + i) % cache->targetCount];
+        if (!target->used || (target->queue == -1) || (target == keep)) {
+            continue;
+        }
+        if (target->count == 0) {
+            _releaseReplyTarget(cache, target);
+            return;
+        }
+        if (busy == NULL) {
+            busy = target;
+            cache->nextVictim = (cache->nextVictim + i + 1) % cache->targetCount;
+        }
+    }
+    if (busy != NULL) {
+        _closeReplyQueue(cache, busy);
+    }
+}
+
+/*
+ * Open the reply queue of a target. Never wait for a client that does not
+ * collect its results: the queue is non-blocking.
+ */
+static int _openReplyQueue(ReplyCache *cache, ReplyTarget *target)
+{
+    if (cache->openQueues >= REPLY_CACHE_SIZE) {
+        _closeSomeReplyQueue(cache, target);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), REPLY_QUEUE_FORMAT, (unsigned)target->client, target->generation);
+    target->queue = mq_open(name, O_WRONLY | O_NONBLOCK);
+    if (target->queue == -1) {
+        return -1;
+    }
+    cache->openQueues++;
+    return 0;
+}
+
+/*
+ * Send the buffered replies of a target, up to REPLY_BATCH per queue
+ * message, opening its queue if needed. What does not fit in the reply
+ * queue stays buffered, and so does everything while no more queues can
+ * be opened. Return -1 if the client is gone or sending failed, the
+ * replies of the target are dropped then.
+ */
+static int _flushReplies(ReplyCache *cache, ReplyTarget *target)
+{
+    if (target->count == 0) {
+        return 0;
+    }
+    if ((target->queue == -1) && (_openReplyQueue(cache, target) != 0)) {
+        if ((errno == EMFILE) || (errno == ENFILE)) {
+            return 0;
+        }
+        _releaseReplyTarget(cache, target);
+        return -1;
+    }
+
+    size_t sent = 0;
+    while (sent < target->count) {
+        size_t count = target->count - sent;
+        if (count > REPLY_BATCH) {
+            count = REPLY_BATCH;
+        }
+        if (mq_send(target->queue, (char*) &target->replies[sent], count * sizeof(Reply), 0) != 0) {
+            if (errno == EAGAIN) {
+                break;
+            }
+            _releaseReplyTarget(cache, target);
+            return -1;
+        }
+        sent += count;
+    }
+
+    memmove(target->replies, &target->replies[sent], (target->count - sent) * sizeof(Reply));
+    target->count -= sent;
+    cache->unsent -= sent;
+    return 0;
+}
+
+/*
+ * Send all replies that are still buffered, as far as the reply queues
+ * have room.
+ */
+static int _flushReplyCache(ReplyCache *cache)
+{
+    int hadError = 0;
+    for (size_t i = 0; (i < cache->targetCount) && (cache->unsent > 0); i++) {
+        if (cache->targets[i]->used && (_flushReplies(cache, cache->targets[i]) != 0)) {
+            hadError = 1;
+        }
+    }
+    return hadError ? -1 : 0;
+}
+
+/*
+ * Send the buffered replies and close all reply queues. Clients get some
+ * time to make room in full reply queues, then their replies are dropped
+ * and receiveResult fails with ETIMEDOUT for them.
+ */
+static int _closeReplyCache(ReplyCache *cache)
+{
+    int result = _flushReplyCache(cache);
+    for (int retry = 0; (retry < REPLY_CLOSE_RETRIES) && (cache->unsent > 0); retry++) {
+        const struct timespec pause = { 0, REPLY_RETRY_NANOS };
+        nanosleep(&pause, NULL);
+        if (_flushReplyCache(cache) != 0) {
+            result = -1;
+        }
+    }
+    if (cache->unsent > 0) {
+        result = -1;
+    }
+
+    for (size_t i = 0; i < cache->targetCount; i++) {
+        _releaseReplyTarget(cache, cache->targets[i]);
+        free(cache->targets[i]);
+    }
+    free(cache->targets);
+    cache->targets        = NULL;
+    cache->targetCount    = 0;
+    cache->targetCapacity = 0;
+    return result;
+}
+
+/*
+ * Return the target of a client. If it has none, return an unused target,
+ * adding one if all are used. Return NULL if out of memory.
+ */
+static ReplyTarget *_findReplyTarget(ReplyCache *cache, int client)
+{
+    // Replies mostly come in runs for one client.
+    if ((cache->last < cache->targetCount) && cache->targets[cache->last]->used &&
+        (cache->targets[cache->last]->client == client)) {
+        return cache->targets[cache->last];
+    }
+
+    ReplyTarget *unused = NULL;
+    for (size_t i = 0; i < cache->targetCount; i++) {
+        ReplyTarget *target = cache->targets[i];
+        if (target->used && (target->client == client)) {
+            cache->last = i;
+            return target;
+        }
+        if (!target->used && (unused == NULL)) {
+            unused = target;
+        }
+    }
+    if (unused != NULL) {
+        return unused;
+    }
+
+    if (cache->targetCount == cache->targetCapacity) {
+        size_t capacity = (cache->targetCapacity == 0) ? REPLY_CACHE_SIZE : 2 * cache->targetCapacity;
+        ReplyTarget **targets = realloc(cache->targets, capacity * sizeof(ReplyTarget*));
+        if (targets == NULL) {
+            return NULL;
+        }
+        cache->targets        = targets;
+        cache->targetCapacity = capacity;
+    }
+    unused = calloc(1, sizeof(ReplyTarget));
+    if (unused == NULL) {
+        return NULL;
+    }
+    unused->queue = -1;
+    cache->targets[cache->targetCount++] = unused;
+    return unused;
+}
+
+/*
+ * Buffer the reply to a request. Replies are sent once REPLY_BATCH of them
+ * are buffered, or by _flushReplyCache. The reply is dropped only if the
+ * client is gone, if it has more than MAX_OUTSTANDING_REQUESTS buffered
+ * (which receiveResult does not allow), or if out of memory.
+ */
+static int _queueReply(ReplyCache *cache, const Message *msg)
+{
+    ReplyTarget *target = _findReplyTarget(cache, msg->client);
+    if (target == NULL) {
+        return -1;
+    }
+
+    if (target->used && (target->generation != msg->generation)) {
+        // The client restarted: the replies still buffered were for a
+        // queue that is gone.
+        _releaseReplyTarget(cache, target);
+    }
+    if (!target->used) {
+        target->used       = 1;
+        target->client     = msg->client;
+        target->generation = msg->generation;
+        target->count      = 0;
+    }
+    if ((target->count >= REPLY_BATCH) && (_flushReplies(cache, target) != 0)) {
+        return -1;
+    }
+    if (target->count == MAX_OUTSTANDING_REQUESTS) {
+        return -1;
+    }
+
+    target->replies[target->count].requestId = msg->requestId;
+    target->replies[target->count].result    = _compute(msg);
+    target->count++;
+    cache->unsent++;
+    return 0;
+}
+
+/*
+ * Write the output buffer of a worker to stdout.
+ */
+static int _flushOutput(Worker *worker)
+{
+    int result = 0;
+    size_t written = 0;
+
+    pthread_mutex_lock(&_outputLock);
+    while (written < worker->outputUsed) {
+        ssize_t count = write(STDOUT_FILENO, worker->output + written, worker->outputUsed - written);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        written += (size_t)count;
+    }
+    pthread_mutex_unlock(&_outputLock);
+
+    worker->outputUsed = 0;
+    return result;
+}
+
+static void *_runWorker(void *arg)
+{
+    Worker *worker = arg;
+    Message messages[256];
+    int hadError = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&worker->lock);
+        while ((worker->count == 0) && !worker->closing) {
+            if ((worker->outputUsed > 0) || (worker->replies.unsent > 0)) {
+                // Nothing to do: write out what is there before sleeping.
+                pthread_mutex_unlock(&worker->lock);
+                hadError |= _flushOutput(worker);
+                hadError |= _flushReplyCache(&worker->replies) != 0;
+                pthread_mutex_lock(&worker->lock);
+                if ((worker->replies.unsent > 0) && (worker->count == 0) && !worker->closing) {
+                    // A reply queue is full: try again once its client had
+                    // time to collect some results.
+                    const struct timespec deadline = _deadline(0, REPLY_RETRY_NANOS);
+                    pthread_cond_timedwait(&worker->notEmpty, &worker->lock, &deadline);
+                }
+                continue;
+            }
+            pthread_cond_wait(&worker->notEmpty, &worker->lock);
+        }
+        if (worker->count == 0) {
+            // Closing and drained.
+            pthread_mutex_unlock(&worker->lock);
+            break;
+        }
+
+        size_t count = 0;
+        while ((count < sizeof(messages) / sizeof(messages[0])) && (worker->count > 0)) {
+            messages[count++] = worker->queue[worker->head];
+            worker->head = (worker->head + 1) % WORKER_QUEUE_SIZE;
+            worker->count--;
+        }
+        pthread_cond_signal(&worker->notFull);
+        pthread_mutex_unlock(&worker->lock);
+
+        for (size_t i = 0; i < count; i++) {
+            const Message *msg = &messages[i];
+            if (OUTPUT_BUFFER_SIZE - worker->outputUsed < MAX_LINE_LENGTH) {
+                hadError |= _flushOutput(worker);
+            }
+
+            char *line = worker->output + worker->outputUsed;
+            int length = 0;
+            if (msg->command == CmdAdd) {
+                length = snprintf(line, MAX_LINE_LENGTH, FORMAT_STRING_ADD,
+                                  msg->parameter1, msg->parameter2, msg->parameter1 + msg->parameter2);
+            } else if (msg->command == CmdSubtract) {
+                length = snprintf(line, MAX_LINE_LENGTH, FORMAT_STRING_SUBTRACT,
+                                  msg->parameter1, msg->parameter2, msg->parameter1 - msg->parameter2);
+            }
+            worker->outputUsed += (size_t)length;
+
+            if (msg->requestId >= 0) {
+                hadError |= _queueReply(&worker->replies, msg) != 0;
+            }
+        }
+    }
+
+    hadError |= _flushOutput(worker);
+    hadError |= _closeReplyCache(&worker->replies) != 0;
+    return hadError ? (void *)1 : NULL;
+}
+
+/*
+ * Hand a message to the worker of its client. Waits while its queue is full.
+ */
+static void _dispatch(Worker *workers, int workerCount, const Message *msg)
+{
+    Worker *worker = &workers[(unsigned)msg->client % (unsigned)workerCount];
+
+    pthread_mutex_lock(&worker->lock);
+    while (worker->count == WORKER_QUEUE_SIZE) {
+        pthread_cond_wait(&worker->notFull, &worker->lock);
+    }
+    worker->queue[(worker->head + worker->count) % WORKER_QUEUE_SIZE] = *msg;
+    worker->count++;
+    pthread_cond_signal(&worker->notEmpty);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/*
+ * Let the workers finish their queues and wait for them.
+ * Return -1 if any of them failed to write its output.
+ */
+static int _stopWorkers(Worker *workers, int workerCount)
+{
+    int hadError = 0;
+
+    for (int i = 0; i < workerCount; i++) {
+        pthread_mutex_lock(&workers[i].lock);
+        workers[i].closing = 1;
+        pthread_cond_signal(&workers[i].notEmpty);
+        pthread_mutex_unlock(&workers[i].lock);
+    }
+    for (int i = 0; i < workerCount; i++) {
+        void *result;
+        pthread_join(workers[i].thread, &result);
+        if (result != NULL) {
+            hadError = 1;
+        }
+        pthread_mutex_destroy(&workers[i].lock);
+        pthread_cond_destroy(&workers[i].notEmpty);
+        pthread_cond_destroy(&workers[i].notFull);
+    }
+    free(workers);
+    return hadError ? -1 : 0;
+}
+
+static Worker *_startWorkers(int workerCount)
+{
+    Worker *workers = calloc((size_t)workerCount, sizeof(Worker));
+    if (workers == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        pthread_cond_init(&workers[i].notEmpty, NULL);
+        pthread_cond_init(&workers[i].notFull, NULL);
+        if (pthread_create(&workers[i].thread, NULL, _runWorker, &workers[i]) != 0) {
+            pthread_mutex_destroy(&workers[i].lock);
+            pthread_cond_destroy(&workers[i].notEmpty);
+            pthread_cond_destroy(&workers[i].notFull);
+            _stopWorkers(workers, i);
+            return NULL;
+        }
+    }
+    return workers;
+}
+
+/*
+ * Run the server with the given number of worker threads (at most
+ * MAX_WORKERS) that compute and print the results. With 0 workers the
+ * server does everything itself and prints with printf.
+ */
+int runServerWithWorkers(int workerCount)
 {
     int didExit = 0, hadError = 0; // flags
-    Message msg;
+    Worker *workers = NULL;
+    ReplyCache *replies = NULL;
+    Message batch[MAX_BATCH_MESSAGES];
     // Flags for options when creating the queue
     int mess_q_flags = O_CREAT | O_RDONLY; //O_RDWR; // 
     //printf("O_CREATE: %d \n", O_CREAT); // output: O_CREATE: 64 -> 00.... 0100 0000
@@ -100,7 +1052,7 @@ int runServer(void)
     struct mq_attr attr; 
     attr.mq_flags   = 0; //| O_RDONLY; // Message queue flags. Read only flag has to be in the message queue attributes
     attr.mq_maxmsg  = 10;           // Maximum number of messages in the queue
-    attr.mq_msgsize = sizeof(msg);  // Maximum message size
+    attr.mq_msgsize = sizeof(batch); // Maximum message size, a whole batch
     attr.mq_curmsgs = 0;            // Number of messages currently queued
     (void) attr;
 
@@ -114,48 +1066,123 @@ int runServer(void)
 	return -1;
     }
 
+    if ((workerCount < 0) || (workerCount > MAX_WORKERS)) {
+        mq_close(server);
+        mq_unlink(QUEUE_NAME);
+        return -1;
+    }
+    if (workerCount > 0) {
+        // The workers write to the file descriptor directly.
+        fflush(stdout);
+        workers = _startWorkers(workerCount);
+        if (workers == NULL) {
+            mq_close(server);
+            mq_unlink(QUEUE_NAME);
+            return -1;
+        }
+    } else {
+        replies = calloc(1, sizeof(ReplyCache));
+        if (replies == NULL) {
+            mq_close(server);
+            mq_unlink(QUEUE_NAME);
+            return -1;
+        }
+    }
+
 
     // This is the implementation of the server
     do {
-        // Attempt to receive a message from the queue.
-        ssize_t received = mq_receive(server, (char*)&msg, sizeof(msg), NULL);
-        if (received != sizeof(msg)) {
+        // Attempt to receive a batch of messages from the queue.
+        // The buffer must be at least mq_msgsize, which is larger than
+        // sizeof(batch) if the queue was created with other attributes.
+        ssize_t received;
+        if ((replies != NULL) && (replies->unsent > 0)) {
+            // A reply queue was full: try again after a while, even if no
+            // message arrives.
+            const struct timespec deadline = _deadline(0, REPLY_RETRY_NANOS);
+            received = mq_timedreceive(server, (char*)batch, sizeof(batch), NULL, &deadline);
+            if ((received == -1) && (errno == ETIMEDOUT)) {
+                if (_flushReplyCache(replies) != 0) {
+                    hadError = 1;
+                }
+                continue;
+            }
+        } else {
+            received = mq_receive(server, (char*)batch, sizeof(batch), NULL);
+        }
+        if ((received <= 0) || (received % sizeof(Message) != 0)) {
             // This implicitly also checks for error (i.e., -1)
             hadError = 1;
+            if ((received == -1) && (errno == EMSGSIZE)) {
+                break;
+            }
             continue;
         }
 
-        switch (msg.command)
-        {
-            case CmdExit:
-                // End this loop.
-                didExit = 1;
-                break;
+        for (size_t i = 0; (i < received / sizeof(Message)) && !didExit; i++) {
+            const Message *msg = &batch[i];
 
-            case CmdAdd:
-                // Print the required output.
-                printf(FORMAT_STRING_ADD,
-                       msg.parameter1,
-                       msg.parameter2,
-                       msg.parameter1 + msg.parameter2);
-                break;
+            if ((workers != NULL) && (msg->command != CmdExit)) {
+                _dispatch(workers, workerCount, msg);
+                continue;
+            }
 
-            case CmdSubtract:
-                // Print the required output.
-                printf(FORMAT_STRING_SUBTRACT,
-                       msg.parameter1,
-                       msg.parameter2,
-                       msg.parameter1 - msg.parameter2);
-                break;
+            switch (msg->command)
+            {
+                case CmdExit:
+                    // End this loop.
+                    didExit = 1;
+                    break;
 
-            default:
-                break;
+                case CmdAdd:
+                    // Print the required output.
+                    printf(FORMAT_STRING_ADD,
+                           msg->parameter1,
+                           msg->parameter2,
+                           msg->parameter1 + msg->parameter2);
+                    break;
+
+                case CmdSubtract:
+                    // Print the required output.
+                    printf(FORMAT_STRING_SUBTRACT,
+                           msg->parameter1,
+                           msg->parameter2,
+                           msg->parameter1 - msg->parameter2);
+                    break;
+
+                default:
+                    break;
+            }
+
+            if ((msg->requestId >= 0) && (msg->command != CmdExit) && (_queueReply(replies, msg) != 0)) {
+                hadError = 1;
+            }
+        }
+
+        if ((replies != NULL) && (_flushReplyCache(replies) != 0)) {
+            hadError = 1;
         }
     } while (!didExit); //  do {...} while (condition) -> run it at least once before checking the condition
 
+    // Let the workers drain their queues
+    if ((workers != NULL) && (_stopWorkers(workers, workerCount) != 0)) {
+        hadError = 1;
+    }
+    if (replies != NULL) {
+        if (_closeReplyCache(replies) != 0) {
+            hadError = 1;
+        }
+        free(replies);
+    }
+
     // Close the message queue on exit and unlink it
     mq_close(server);
     mq_unlink(QUEUE_NAME);
 
     return hadError ? -1 : 0;
 }
+
+int runServer(void)
+{
+    return runServerWithWorkers(0);
+}
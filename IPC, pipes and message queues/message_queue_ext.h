@@ -0,0 +1,39 @@
+#pragma once
+#include "message_queue.h"
+
+/*
+ * The calculator functions beyond the one message per call interface.
+ */
+
+/*
+ * Like sendAddTask/sendSubtractTask, but the message is only sent with the
+ * next flushTasks for the client (or once a queue message is full).
+ */
+int queueAddTask(mqd_t client, int operand1, int operand2);
+int queueSubtractTask(mqd_t client, int operand1, int operand2);
+/*
+ * Send the messages queued for the client, by any thread. Return -1 on
+ * error, the messages that were not sent stay queued then.
+ */
+int flushTasks(mqd_t client);
+
+/*
+ * Run the server with workerCount worker threads (0 to MAX_WORKERS, 64)
+ * that compute and print the results. With 0 workers it is runServer.
+ */
+int runServerWithWorkers(int workerCount);
+
+/*
+ * Like queueAddTask/queueSubtractTask, but the server also sends the
+ * result back. Return the request ID that receiveResult reports with the
+ * result, or -1 on error (errno EAGAIN if MAX_OUTSTANDING_REQUESTS results
+ * were not collected yet).
+ */
+int sendAddRequest(mqd_t client, int operand1, int operand2);
+int sendSubtractRequest(mqd_t client, int operand1, int operand2);
+/*
+ * Wait for the next result of the client's requests, in request order.
+ * Return -1 on error, if none is outstanding, or with errno ETIMEDOUT if
+ * none arrived in time.
+ */
+int receiveResult(mqd_t client, int *requestId, int *result);
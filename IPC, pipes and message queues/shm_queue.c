@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include "message_queue.h"
+#include "message_queue_ext.h"
+#include "calculator.h"
+#include <fcntl.h>           /* For O_* constants ->file control options */
+#include <sys/stat.h>        /* For mode constants */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+
+/*
+ * A replacement for message_queue.c (link one or the other) that passes
+ * the messages through a ring buffer in shared memory instead of a POSIX
+ * message queue. Only the functions of message_queue.h and the batching
+ * functions are implemented, not runServerWithWorkers or the requests
+ * whose results are sent back.
+ *
+ * Any number of client threads and processes enqueue into the ring without
+ * locks; the server is the only consumer. Each slot has a sequence number
+ * that tells whether it is free for the producer at a position or holds a
+ * message for the consumer. Futexes are used only to sleep when the ring
+ * is empty (server) or full (clients), so while messages keep flowing no
+ * system call is made. The mqd_t returned by startClient is not a real
+ * queue descriptor, only 0 on success.
+ */
+
+#define SHM_NAME   "/simple_calculator_ring"
+#define RING_SIZE  4096 // Must be a power of two
+#define RING_MASK  (RING_SIZE - 1)
+#define RING_MAGIC 0x52494e47u
+// Times to check an empty or full ring again before going to sleep
+#define SPIN_LIMIT 256
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+typedef struct _Slot {
+    /*
+     * Equal to the position if the slot is free for the producer that
+     * claimed that position, position + 1 once the message is in it.
+     */
+    uint64_t sequence;
+    Message message;
+} Slot;
+
+/*
+ * The shared memory segment. Fields written by different sides are on
+ * cache lines of their own.
+ */
+typedef struct _Ring {
+    /*
+     * RING_MAGIC once the server initialized the ring.
+     */
+    uint32_t magic;
+    /*
+     * The server that created the ring, so a ring left over by a server
+     * that is gone can be told from the ring of a running one.
+     */
+    pid_t serverPid;
+    /*
+     * The next position producers claim.
+     */
+    uint64_t tail __attribute__ ((aligned(64)));
+    /*
+     * The next position the server reads, only written by the server.
+     */
+    uint64_t head __attribute__ ((aligned(64)));
+    /*
+     * Futex words: bumped whenever a sleeping server must wake up because
+     * a message arrived, or sleeping clients because a slot was freed.
+     */
+    uint32_t serverWaiting __attribute__ ((aligned(64)));
+    uint32_t dataEvent;
+    uint32_t clientsWaiting __attribute__ ((aligned(64)));
+    uint32_t spaceEvent;
+    Slot slots[RING_SIZE] __attribute__ ((aligned(64)));
+} Ring;
+
+static Ring *_ring;
+static int _clientCount;
+static pthread_mutex_t _clientLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _futexWait(uint32_t *address, uint32_t expected)
+{
+    // Shared between processes, so no FUTEX_PRIVATE_FLAG.
+    syscall(SYS_futex, address, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+static void _futexWake(uint32_t *address, int count)
+{
+    syscall(SYS_futex, address, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/*
+ * Map the ring. Fails with EINVAL if an existing segment is too small.
+ */
+static Ring *_mapRing(int flags)
+{
+    int fd = shm_open(SHM_NAME, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (flags & O_CREAT) {
+        if (ftruncate(fd, sizeof(Ring)) != 0) {
+            close(fd);
+            return NULL;
+        }
+    } else {
+        struct stat status;
+        if ((fstat(fd, &status) != 0) || ((size_t)status.st_size < sizeof(Ring))) {
+            close(fd);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    void *ring = mmap(NULL, sizeof(Ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return (ring == MAP_FAILED) ? NULL : ring;
+}
+
+/*
+ * Create the ring for a new server. The ring of a running server is never
+ * truncated: then NULL is returned with errno EEXIST. A ring left over by
+ * a server that is gone is unlinked and created again.
+ */
+static Ring *_createRing(void)
+{
+    Ring *ring = _mapRing(O_CREAT | O_EXCL | O_RDWR);
+    if ((ring != NULL) || (errno != EEXIST)) {
+        return ring;
+    }
+
+    int stale = 0;
+    Ring *old = _mapRing(O_RDWR);
+    if (old != NULL) {
+        const pid_t pid = __atomic_load_n(&old->serverPid, __ATOMIC_RELAXED);
+        stale = (pid <= 0) || ((kill(pid, 0) == -1) && (errno == ESRCH));
+        munmap(old, sizeof(Ring));
+    } else {
+        stale = (errno == EINVAL);
+    }
+    if (!stale) {
+        errno = EEXIST;
+        return NULL;
+    }
+
+    // If another server starts meanwhile, one of the two gets EEXIST here.
+    shm_unlink(SHM_NAME);
+    return _mapRing(O_CREAT | O_EXCL | O_RDWR);
+}
+
+/*
+ * Claim a position in the ring, put the message there and wake the server
+ * if it sleeps. Blocks while the ring is full.
+ */
+static int _enqueue(Ring *ring, Command command, int operand1, int operand2)
+{
+    uint64_t position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    Slot *slot;
+    int spins = 0;
+
+    for (;;) {
+        slot = &ring->slots[position & RING_MASK];
+        const uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        const int64_t difference = (int64_t)(sequence - position);
+
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &position, position + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // Full: the server has not read the message of the last round yet.
+            if (++spins < SPIN_LIMIT) {
+                cpu_relax();
+            } else {
+                const uint32_t event = __atomic_load_n(&ring->spaceEvent, __ATOMIC_ACQUIRE);
+                __atomic_fetch_add(&ring->clientsWaiting, 1, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) == sequence) {
+                    _futexWait(&ring->spaceEvent, event);
+                }
+                __atomic_fetch_sub(&ring->clientsWaiting, 1, __ATOMIC_RELAXED);
+                spins = 0;
+            }
+            position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        } else {
+            // Another client claimed this position meanwhile.
+            position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->message.command    = command;
+    slot->message.parameter1 = operand1;
+    slot->message.parameter2 = operand2;
+    slot->message.client     = 0;
+    slot->message.requestId  = -1;
+    slot->message.generation = 0;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->serverWaiting, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&ring->dataEvent, 1, __ATOMIC_RELEASE);
+        _futexWake(&ring->dataEvent, 1);
+    }
+    return 0;
+}
+
+/*
+ * Take the next message out of the ring. Blocks while the ring is empty.
+ */
+static void _dequeue(Ring *ring, Message *msg)
+{
+    const uint64_t position = ring->head;
+    Slot *slot = &ring->slots[position & RING_MASK];
+    int spins = 0;
+
+    while (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+        if (++spins < SPIN_LIMIT) {
+            cpu_relax();
+            continue;
+        }
+
+        const uint32_t event = __atomic_load_n(&ring->dataEvent, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&ring->serverWaiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+            _futexWait(&ring->dataEvent, event);
+        }
+        __atomic_store_n(&ring->serverWaiting, 0, __ATOMIC_RELAXED);
+        spins = 0;
+    }
+
+    *msg = slot->message;
+    __atomic_store_n(&slot->sequence, position + RING_SIZE, __ATOMIC_RELEASE);
+    ring->head = position + 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->clientsWaiting, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&ring->spaceEvent, 1, __ATOMIC_RELEASE);
+        _futexWake(&ring->spaceEvent, INT_MAX);
+    }
+}
+
+mqd_t startClient(void)
+{
+    // Map the ring previously created by the server, once per process.
+    pthread_mutex_lock(&_clientLock);
+    if (_clientCount == 0) {
+        Ring *ring = _mapRing(O_RDWR);
+        if ((ring == NULL) || (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != RING_MAGIC)) {
+            if (ring != NULL) {
+                munmap(ring, sizeof(Ring));
+            }
+            pthread_mutex_unlock(&_clientLock);
+            return -1;
+        }
+        __atomic_store_n(&_ring, ring, __ATOMIC_RELEASE);
+    }
+    _clientCount++;
+    pthread_mutex_unlock(&_clientLock);
+    return 0;
+}
+
+/*
+ * Enqueue into the ring of this process. Fails with EBADF if no client is
+ * started.
+ */
+static int _send(Command command, int operand1, int operand2)
+{
+    Ring *ring = __atomic_load_n(&_ring, __ATOMIC_ACQUIRE);
+    if (ring == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    return _enqueue(ring, command, operand1, operand2);
+}
+
+int sendExitTask(mqd_t client)
+{
+    (void)client;
+    return _send(CmdExit, 0, 0);
+}
+
+int sendAddTask(mqd_t client, int operand1, int operand2)
+{
+    (void)client;
+    return _send(CmdAdd, operand1, operand2);
+}
+
+int sendSubtractTask(mqd_t client, int operand1, int operand2)
+{
+    (void)client;
+    return _send(CmdSubtract, operand1, operand2);
+}
+
+/*
+ * The batch API of message_queue.c. Enqueueing costs no system call here,
+ * so there is nothing to batch.
+ */
+int queueAddTask(mqd_t client, int operand1, int operand2)
+{
+    return sendAddTask(client, operand1, operand2);
+}
+
+int queueSubtractTask(mqd_t client, int operand1, int operand2)
+{
+    return sendSubtractTask(client, operand1, operand2);
+}
+
+int flushTasks(mqd_t client)
+{
+    (void)client;
+    return 0;
+}
+
+int stopClient(mqd_t client)
+{
+    (void)client;
+    // Unmap the ring once the last client of this process stopped.
+    pthread_mutex_lock(&_clientLock);
+    if (_clientCount == 0) {
+        pthread_mutex_unlock(&_clientLock);
+        return -1;
+    }
+    if (--_clientCount == 0) {
+        Ring *ring = _ring;
+        __atomic_store_n(&_ring, NULL, __ATOMIC_RELEASE);
+        munmap(ring, sizeof(Ring));
+    }
+    pthread_mutex_unlock(&_clientLock);
+    return 0;
+}
+
+int runServer(void)
+{
+    int didExit = 0;
+    Message msg;
+
+    // Create the ring. Clients refuse to use it until the magic is set.
+    Ring *ring = _createRing();
+    if (ring == NULL) {
+        return -1;
+    }
+    __atomic_store_n(&ring->serverPid, getpid(), __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->magic, 0, __ATOMIC_RELAXED);
+    ring->tail           = 0;
+    ring->head           = 0;
+    ring->serverWaiting  = 0;
+    ring->dataEvent      = 0;
+    ring->clientsWaiting = 0;
+    ring->spaceEvent     = 0;
+    for (uint64_t i = 0; i < RING_SIZE; i++) {
+        ring->slots[i].sequence = i;
+    }
+    __atomic_store_n(&ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+
+    // This is the implementation of the server
+    do {
+        _dequeue(ring, &msg);
+
+        switch (msg.command)
+        {
+            case CmdExit:
+                // End this loop.
+                didExit = 1;
+                break;
+
+            case CmdAdd:
+                // Print the required output.
+                printf(FORMAT_STRING_ADD,
+                       msg.parameter1,
+                       msg.parameter2,
+                       msg.parameter1 + msg.parameter2);
+                break;
+
+            case CmdSubtract:
+                // Print the required output.
+                printf(FORMAT_STRING_SUBTRACT,
+                       msg.parameter1,
+                       msg.parameter2,
+                       msg.parameter1 - msg.parameter2);
+                break;
+
+            default:
+                break;
+        }
+    } while (!didExit);
+
+    // Unmap the ring on exit and unlink it
+    __atomic_store_n(&ring->magic, 0, __ATOMIC_RELAXED);
+    munmap(ring, sizeof(Ring));
+    shm_unlink(SHM_NAME);
+
+    return 0;
+}
@@ -5,58 +5,451 @@
 #include <alloca.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
 
 #include "multi_mutex.h"
+#include "multi_mutex_ext.h"
 
-static pthread_mutex_t LOCK = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_mutex_t LOCK2 = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#ifdef MULTI_MUTEX_PROFILE
+// Contention profiling, compiled in with -DMULTI_MUTEX_PROFILE.
+// Every thread counts into a buffer of its own, a small hash table keyed by
+// mutex address, so the fast path touches no shared cache line. Buffers are
+// never freed: when a thread exits its buffer is handed to the next new
+// thread and keeps counting, so no data is lost.
+#define PROFILE_SLOTS      512
+#define PROFILE_POSITIONS  8
+#define PROFILE_HOLD_BINS  32
+
+typedef struct profile_entry
+{
+    pthread_mutex_t *mutex;
+    uint64_t acquisitions;
+    uint64_t failures;
+    uint64_t rollbacks;
+    uint64_t hold_total_ns;
+    uint64_t locked_at_ns;
+    // Failures by position in the arr, the last one counts all later ones
+    uint32_t failure_positions[PROFILE_POSITIONS];
+    // Hold times, bin i counts those of 2^(i-1) to 2^i - 1 ns
+    uint32_t hold_bins[PROFILE_HOLD_BINS];
+} profile_entry;
+
+typedef struct profile_buffer
+{
+    profile_entry entries[PROFILE_SLOTS];
+    // Mutexes not counted because the table was full
+    uint64_t untracked;
+    struct profile_buffer *next_buffer;
+    struct profile_buffer *next_free;
+} profile_buffer;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+static pthread_key_t profile_key;
+static profile_buffer *all_buffers;
+static profile_buffer *free_buffers;
+static __thread profile_buffer *thread_buffer;
+
+static uint64_t profile_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void profile_thread_exit(void *buffer)
+{
+    pthread_mutex_lock(&profile_lock);
+    ((profile_buffer *)buffer)->next_free = free_buffers;
+    free_buffers = buffer;
+    pthread_mutex_unlock(&profile_lock);
+}
+
+static void profile_init(void)
+{
+    pthread_key_create(&profile_key, profile_thread_exit);
+}
+
+// Slow path, once per thread
+static profile_buffer *profile_new_buffer(void)
+{
+    pthread_once(&profile_once, profile_init);
+
+    pthread_mutex_lock(&profile_lock);
+    profile_buffer *buffer = free_buffers;
+    if (buffer)
+    {
+        free_buffers = buffer->next_free;
+    }
+    else
+    {
+        buffer = calloc(1, sizeof(profile_buffer));
+        if (buffer)
+        {
+            buffer->next_buffer = all_buffers;
+            all_buffers = buffer;
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    if (buffer)
+    {
+        pthread_setspecific(profile_key, buffer);
+    }
+    return buffer;
+}
+
+// The entry of the mutex in the buffer of this thread, NULL if it is full
+static profile_entry *profile_entry_for(pthread_mutex_t *mutex)
+{
+    profile_buffer *buffer = thread_buffer;
+    if (!buffer)
+    {
+        buffer = thread_buffer = profile_new_buffer();
+        if (!buffer)
+        {
+            return NULL;
+        }
+    }
+
+    size_t slot = (size_t)(((uintptr_t)mutex * 0x9e3779b97f4a7c15ull) >> 32) % PROFILE_SLOTS;
+    for (size_t probe = 0; probe < PROFILE_SLOTS; probe++)
+    {
+        profile_entry *entry = &buffer->entries[slot];
+        if (entry->mutex == mutex)
+        {
+            return entry;
+        }
+        if (!entry->mutex)
+        {
+            entry->mutex = mutex;
+            return entry;
+        }
+        slot = (slot + 1) % PROFILE_SLOTS;
+    }
+    buffer->untracked++;
+    return NULL;
+}
+
+static void profile_acquired(pthread_mutex_t **mutexv, size_t count)
+{
+    uint64_t now = profile_now();
+    for (size_t i = 0; i < count; i++)
+    {
+        profile_entry *entry = profile_entry_for(mutexv[i]);
+        if (entry)
+        {
+            entry->acquisitions++;
+            entry->locked_at_ns = now;
+        }
+    }
+}
+
+// The mutex at position failed, the ones before it are rolled back
+static void profile_failed(pthread_mutex_t **mutexv, size_t position)
+{
+    profile_entry *entry = profile_entry_for(mutexv[position]);
+    if (entry)
+    {
+        entry->failures++;
+        entry->failure_positions[position < PROFILE_POSITIONS ? position : PROFILE_POSITIONS - 1]++;
+    }
+    for (size_t i = 0; i < position; i++)
+    {
+        entry = profile_entry_for(mutexv[i]);
+        if (entry)
+        {
+            entry->rollbacks++;
+        }
+    }
+}
+
+static void profile_released(pthread_mutex_t **mutexv, size_t count)
+{
+    uint64_t now = profile_now();
+    for (size_t i = 0; i < count; i++)
+    {
+        profile_entry *entry = profile_entry_for(mutexv[i]);
+        // Not locked through the wrappers by this thread: no hold time
+        if (!entry || !entry->locked_at_ns)
+        {
+            continue;
+        }
+
+        uint64_t hold = now - entry->locked_at_ns;
+        int bin = hold ? 64 - __builtin_clzll(hold) : 0;
+        entry->hold_bins[bin < PROFILE_HOLD_BINS ? bin : PROFILE_HOLD_BINS - 1]++;
+        entry->hold_total_ns += hold;
+        entry->locked_at_ns = 0;
+    }
+}
+#else
+#define profile_acquired(mutexv, count) ((void)0)
+#define profile_failed(mutexv, position) ((void)0)
+#define profile_released(mutexv, count) ((void)0)
+#endif
 
 // arr of pointers, if it is NULL -> end of arr
+// No global lock is taken: callers with disjoint sets never wait for each
+// other. Mutexes are released in the reverse order of the arr; on an error
+// the rest is still released and -1 is returned.
 int multi_mutex_unlock(pthread_mutex_t **mutexv) 
 {
-    // printf("unlock!\n");
+    size_t count = 0;
+    while (mutexv[count])
+    {
+        count++;
+    }
+
+    profile_released(mutexv, count);
 
-    pthread_mutex_lock(&LOCK2);
-    while (*mutexv)
+    int result = 0;
+    while (count > 0)
     {
-        // printf("unlock!\n");
+        count--;
         // built-in mutex returns error if unsuccessful, 0 if successful
-        int return_value = pthread_mutex_unlock(*mutexv); 
+        if (pthread_mutex_unlock(mutexv[count]) != 0)
+        {
+            result = -1;
+        }
+    }
+    return result;
+}
 
-        if (return_value != 0)
+// Either all mutexes of the arr are acquired, or none: on failure, the
+// ones acquired so far are released again, in reverse order.
+int multi_mutex_trylock(pthread_mutex_t **mutexv)
+{
+    size_t i;
+    for (i = 0; mutexv[i]; i++)
+    {
+        int was_successful = pthread_mutex_trylock(mutexv[i]);
+
+        if (was_successful != 0)
         {
-            pthread_mutex_unlock(&LOCK2);
+            profile_failed(mutexv, i);
+            while (i > 0)
+            {
+                i--;
+                pthread_mutex_unlock(mutexv[i]);
+            }
             return -1;
         }
-        mutexv++;
     }
-    pthread_mutex_unlock(&LOCK2);
+    profile_acquired(mutexv, i);
     return 0;
 }
 
-int multi_mutex_trylock(pthread_mutex_t **mutexv)
+// Spin attempts before blocking on a mutex, adapted per thread: doubled
+// when spinning paid off, halved when the thread had to block anyway
+#define MIN_SPINS 4
+#define MAX_SPINS 1024
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+static __thread int spin_limit = MIN_SPINS * 4;
+
+static int compare_mutex_addresses(const void *a, const void *b)
+{
+    uintptr_t first = (uintptr_t)*(pthread_mutex_t * const *)a;
+    uintptr_t second = (uintptr_t)*(pthread_mutex_t * const *)b;
+    return (first > second) - (first < second);
+}
+
+// Spin on trylock for a while, then block
+static int lock_adaptive(pthread_mutex_t *mutex)
 {
-    // printf("trylock!\n");
-    pthread_mutex_lock(&LOCK);
-    // Store the beginning of the arr
-    pthread_mutex_t **beginning_arr = mutexv;
-    while (*mutexv)
+    for (int spin = 0; spin < spin_limit; spin++)
+    {
+        int return_value = pthread_mutex_trylock(mutex);
+        if (return_value != EBUSY)
+        {
+            if (return_value == 0 && spin > 0 && spin_limit < MAX_SPINS)
+            {
+                spin_limit *= 2;
+            }
+            return return_value;
+        }
+        cpu_relax();
+    }
+
+    if (spin_limit > MIN_SPINS)
     {
-        // printf("trylock!\n");
-        int was_successful = pthread_mutex_trylock(*mutexv);
+        spin_limit /= 2;
+    }
+    return pthread_mutex_lock(mutex);
+}
 
-        if (was_successful != 0)
+// Blocks until all mutexes of the NULL-terminated arr are held.
+// They are acquired in address order, so two callers can never wait for
+// each other in a cycle. A mutex must not appear twice in the arr.
+// On failure, all previously acquired mutexes are released.
+int multi_mutex_lock(pthread_mutex_t **mutexv)
+{
+    size_t count = 0;
+    while (mutexv[count])
+    {
+        count++;
+    }
+
+    pthread_mutex_t **sorted = alloca(count * sizeof(pthread_mutex_t *));
+    memcpy(sorted, mutexv, count * sizeof(pthread_mutex_t *));
+    qsort(sorted, count, sizeof(pthread_mutex_t *), compare_mutex_addresses);
+
+    for (size_t i = 1; i < count; i++)
+    {
+        if (sorted[i] == sorted[i - 1])
+        {
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (lock_adaptive(sorted[i]) != 0)
         {
-            while (*beginning_arr != *mutexv)
+            while (i > 0)
             {
-                pthread_mutex_unlock(*beginning_arr);
-                beginning_arr++;
+                i--;
+                pthread_mutex_unlock(sorted[i]);
             }
-            pthread_mutex_unlock(&LOCK);
             return -1;
         }
-        mutexv++;
     }
-    pthread_mutex_unlock(&LOCK);
+    profile_acquired(sorted, count);
     return 0;
 }
+
+#ifdef MULTI_MUTEX_PROFILE
+static int compare_entry_mutexes(const void *a, const void *b)
+{
+    return compare_mutex_addresses(&((const profile_entry *)a)->mutex, &((const profile_entry *)b)->mutex);
+}
+
+static int compare_failures(const void *a, const void *b)
+{
+    const profile_entry *first = a;
+    const profile_entry *second = b;
+    return (first->failures < second->failures) - (first->failures > second->failures);
+}
+
+// Adds up the buffers of all threads. Counts of running threads may be a
+// little behind, the buffers are read without stopping them.
+void multi_mutex_profile_report(FILE *out, int top)
+{
+    pthread_mutex_lock(&profile_lock);
+    size_t capacity = 0;
+    for (profile_buffer *buffer = all_buffers; buffer; buffer = buffer->next_buffer)
+    {
+        capacity += PROFILE_SLOTS;
+    }
+
+    profile_entry *totals = calloc(capacity ? capacity : 1, sizeof(profile_entry));
+    if (!totals)
+    {
+        pthread_mutex_unlock(&profile_lock);
+        fprintf(out, "multi_mutex profile: out of memory\n");
+        return;
+    }
+
+    size_t used = 0;
+    uint64_t untracked = 0;
+    for (profile_buffer *buffer = all_buffers; buffer; buffer = buffer->next_buffer)
+    {
+        untracked += buffer->untracked;
+        for (size_t slot = 0; slot < PROFILE_SLOTS; slot++)
+        {
+            if (buffer->entries[slot].mutex)
+            {
+                totals[used++] = buffer->entries[slot];
+            }
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    // Merge the entries of the same mutex from different threads
+    qsort(totals, used, sizeof(profile_entry), compare_entry_mutexes);
+    size_t count = 0;
+    for (size_t i = 0; i < used; i++)
+    {
+        if (count == 0 || totals[count - 1].mutex != totals[i].mutex)
+        {
+            totals[count++] = totals[i];
+            continue;
+        }
+
+        profile_entry *total = &totals[count - 1];
+
+        total->acquisitions += totals[i].acquisitions;
+        total->failures += totals[i].failures;
+        total->rollbacks += totals[i].rollbacks;
+        total->hold_total_ns += totals[i].hold_total_ns;
+        for (int p = 0; p < PROFILE_POSITIONS; p++)
+        {
+            total->failure_positions[p] += totals[i].failure_positions[p];
+        }
+        for (int b = 0; b < PROFILE_HOLD_BINS; b++)
+        {
+            total->hold_bins[b] += totals[i].hold_bins[b];
+        }
+    }
+
+    qsort(totals, count, sizeof(profile_entry), compare_failures);
+
+    fprintf(out, "%-18s %12s %10s %8s %9s %10s %12s\n",
+        "mutex", "acquired", "failed", "fail%", "avg_pos", "rollbacks", "avg_hold_ns");
+    for (size_t i = 0; i < count && (int)i < top; i++)
+    {
+        const profile_entry *entry = &totals[i];
+        uint64_t attempts = entry->acquisitions + entry->failures;
+        uint64_t position_sum = 0, holds = 0;
+        for (int p = 0; p < PROFILE_POSITIONS; p++)
+        {
+            position_sum += (uint64_t)p * entry->failure_positions[p];
+        }
+        for (int b = 0; b < PROFILE_HOLD_BINS; b++)
+        {
+            holds += entry->hold_bins[b];
+        }
+
+        fprintf(out, "%-18p %12llu %10llu %7.2f%% %9.2f %10llu %12llu\n",
+            (void *)entry->mutex,
+            (unsigned long long)entry->acquisitions,
+            (unsigned long long)entry->failures,
+            attempts ? 100.0 * entry->failures / attempts : 0.0,
+            entry->failures ? (double)position_sum / entry->failures : 0.0,
+            (unsigned long long)entry->rollbacks,
+            (unsigned long long)(holds ? entry->hold_total_ns / holds : 0));
+
+        // Hold time histogram, one line per non-empty power of two
+        for (int b = 0; b < PROFILE_HOLD_BINS; b++)
+        {
+            if (entry->hold_bins[b])
+            {
+                fprintf(out, "    hold %s %12llu ns: %10u\n",
+                    b < PROFILE_HOLD_BINS - 1 ? "< " : ">=",
+                    b < PROFILE_HOLD_BINS - 1 ? 1ull << b : 1ull << (b - 1),
+                    entry->hold_bins[b]);
+            }
+        }
+    }
+    if (untracked)
+    {
+        fprintf(out, "%llu mutex uses not tracked (per-thread table full)\n",
+            (unsigned long long)untracked);
+    }
+    free(totals);
+}
+#else
+void multi_mutex_profile_report(FILE *out, int top)
+{
+    (void)top;
+    fprintf(out, "multi_mutex profile: not compiled in (build with -DMULTI_MUTEX_PROFILE)\n");
+}
+#endif
@@ -0,0 +1,480 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "multi_mutex.h"
+#include "multi_mutex_ext.h"
+
+// Stress test and benchmark for the multi_mutex wrappers.
+//
+// Every workload runs for a fixed time with 1, 2, 4, ... up to max_threads
+// threads and reports lock-set acquisitions per second, trylock retries per
+// acquisition, Jain's fairness index over the acquisitions each thread got
+// done in that time and the p99 time to acquire a set. A failed trylock is
+// retried after sched_yield().
+//
+// Each mutex guards a counter that is updated non-atomically, and at the
+// end the counters must add up and every mutex must be free again, so lost
+// updates and leaked locks are caught.
+
+#define MAX_BENCH_THREADS 64
+#define MAX_SET           4
+#define ACCOUNTS          64
+#define HOT_MUTEXES       8
+#define LATENCY_SAMPLES   65536
+// Only every SAMPLE_INTERVAL-th acquisition is timed, so that the two
+// clock_gettime calls do not dominate the short critical sections
+#define SAMPLE_INTERVAL   16
+#define INITIAL_BALANCE   1000
+
+typedef struct worker
+{
+    pthread_t thread;
+    int index;
+    unsigned seed;
+    uint64_t acquisitions;
+    uint64_t retries;
+    uint64_t sample_count;
+    uint64_t *samples;
+} worker;
+
+typedef struct workload
+{
+    const char *name;
+    // Number of mutexes the workload needs for the given thread count
+    int (*mutex_count)(int threads);
+    // Fill the NULL-terminated set for the next operation, return its size
+    int (*pick)(worker *self, pthread_mutex_t **set, int *indexes);
+    // Update the data guarded by the set
+    void (*update)(worker *self, int *indexes, int count);
+    // Check the data once all threads are done, return 0 if it is right
+    int (*check)(void);
+} workload;
+
+// Padded so threads working on different mutexes share no cache line
+typedef struct guarded
+{
+    pthread_mutex_t mutex;
+    long value;
+} __attribute__ ((aligned(64))) guarded;
+
+static guarded *slots;
+static int slot_count;
+static int thread_count;
+static unsigned duration_ms = 200;
+static int use_blocking_lock;
+// Workers start together once all of them are created, and run until stop
+static pthread_barrier_t start_barrier;
+static int stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static int count_philosophers(int threads)
+{
+    return threads < 2 ? 2 : threads;
+}
+
+static int count_accounts(int threads)
+{
+    (void)threads;
+    return ACCOUNTS;
+}
+
+static int count_hot(int threads)
+{
+    (void)threads;
+    return HOT_MUTEXES;
+}
+
+static int count_disjoint(int threads)
+{
+    return threads * 3;
+}
+
+// Philosopher i needs forks i and i + 1
+static int pick_forks(worker *self, pthread_mutex_t **set, int *indexes)
+{
+    indexes[0] = self->index % slot_count;
+    indexes[1] = (self->index + 1) % slot_count;
+    set[0] = &slots[indexes[0]].mutex;
+    set[1] = &slots[indexes[1]].mutex;
+    set[2] = NULL;
+    return 2;
+}
+
+// 2 to MAX_SET distinct random mutexes out of all slots
+static int pick_random(worker *self, pthread_mutex_t **set, int *indexes)
+{
+    int count = 2 + rand_r(&self->seed) % (MAX_SET - 1);
+    for (int i = 0; i < count; i++)
+    {
+        int index, duplicate;
+        do
+        {
+            index = rand_r(&self->seed) % slot_count;
+            duplicate = 0;
+            for (int j = 0; j < i; j++)
+            {
+                duplicate |= indexes[j] == index;
+            }
+        } while (duplicate);
+
+        indexes[i] = index;
+        set[i] = &slots[index].mutex;
+    }
+    set[count] = NULL;
+    return count;
+}
+
+// Three mutexes owned by this thread alone
+static int pick_own(worker *self, pthread_mutex_t **set, int *indexes)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        indexes[i] = self->index * 3 + i;
+        set[i] = &slots[indexes[i]].mutex;
+    }
+    set[3] = NULL;
+    return 3;
+}
+
+// Count one use of every mutex in the set
+static void update_counts(worker *self, int *indexes, int count)
+{
+    (void)self;
+    for (int i = 0; i < count; i++)
+    {
+        long value = slots[indexes[i]].value;
+        __asm__ __volatile__("" ::: "memory");
+        slots[indexes[i]].value = value + 1;
+    }
+}
+
+// Move money from the first account to the others
+static void update_transfer(worker *self, int *indexes, int count)
+{
+    for (int i = 1; i < count; i++)
+    {
+        long amount = rand_r(&self->seed) % 10;
+        long from = slots[indexes[0]].value;
+        long to = slots[indexes[i]].value;
+        __asm__ __volatile__("" ::: "memory");
+        slots[indexes[0]].value = from - amount;
+        slots[indexes[i]].value = to + amount;
+    }
+}
+
+static uint64_t expected_uses;
+
+static int check_counts(void)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < slot_count; i++)
+    {
+        total += slots[i].value;
+    }
+    return total == expected_uses ? 0 : -1;
+}
+
+static int check_balance(void)
+{
+    long total = 0;
+    for (int i = 0; i < slot_count; i++)
+    {
+        total += slots[i].value;
+    }
+    return total == (long)slot_count * INITIAL_BALANCE ? 0 : -1;
+}
+
+static const workload workloads[] = {
+    { "philosophers", count_philosophers, pick_forks,  update_counts,   check_counts },
+    { "transfer",     count_accounts,     pick_random, update_transfer, check_balance },
+    { "overlap",      count_hot,          pick_random, update_counts,   check_counts },
+    { "disjoint",     count_disjoint,     pick_own,    update_counts,   check_counts },
+};
+
+static const workload *current;
+
+static void *run_worker(void *arg)
+{
+    worker *self = arg;
+    pthread_mutex_t *set[MAX_SET + 1];
+    int indexes[MAX_SET];
+    uint64_t uses = 0;
+
+    pthread_barrier_wait(&start_barrier);
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        int count = current->pick(self, set, indexes);
+        int sample = (self->acquisitions % SAMPLE_INTERVAL == 0) && (self->sample_count < LATENCY_SAMPLES);
+        uint64_t start = sample ? now_ns() : 0;
+
+        if (use_blocking_lock)
+        {
+            if (multi_mutex_lock(set) != 0)
+            {
+                fprintf(stderr, "multi_mutex_lock failed\n");
+                exit(1);
+            }
+        }
+        else
+        {
+            while (multi_mutex_trylock(set) != 0)
+            {
+                self->retries++;
+                sched_yield();
+            }
+        }
+        if (sample)
+        {
+            self->samples[self->sample_count++] = now_ns() - start;
+        }
+
+        current->update(self, indexes, count);
+        self->acquisitions++;
+        uses += count;
+
+        if (multi_mutex_unlock(set) != 0)
+        {
+            fprintf(stderr, "multi_mutex_unlock failed\n");
+            exit(1);
+        }
+    }
+
+    __atomic_fetch_add(&expected_uses, uses, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Every mutex must be free once all threads are done
+static int check_no_leaks(void)
+{
+    for (int i = 0; i < slot_count; i++)
+    {
+        if (pthread_mutex_trylock(&slots[i].mutex) != 0)
+        {
+            return -1;
+        }
+        pthread_mutex_unlock(&slots[i].mutex);
+    }
+    return 0;
+}
+
+static int run_workload(const workload *work, int threads)
+{
+    current = work;
+    thread_count = threads;
+    slot_count = work->mutex_count(threads);
+    expected_uses = 0;
+
+    slots = aligned_alloc(64, slot_count * sizeof(guarded));
+    for (int i = 0; i < slot_count; i++)
+    {
+        pthread_mutex_init(&slots[i].mutex, NULL);
+        slots[i].value = (work->check == check_balance) ? INITIAL_BALANCE : 0;
+    }
+
+    worker *workers = calloc(threads, sizeof(worker));
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].index = i;
+        workers[i].seed = i + 1;
+        workers[i].samples = malloc(LATENCY_SAMPLES * sizeof(uint64_t));
+    }
+
+    stop = 0;
+    pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+
+    struct timespec duration = { duration_ms / 1000, (long)(duration_ms % 1000) * 1000000 };
+    while (nanosleep(&duration, &duration) != 0)
+    {
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+
+    uint64_t acquisitions = 0, retries = 0, sample_count = 0;
+    double sum = 0, sum_squares = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        acquisitions += workers[i].acquisitions;
+        retries += workers[i].retries;
+        sample_count += workers[i].sample_count;
+        sum += workers[i].acquisitions;
+        sum_squares += (double)workers[i].acquisitions * workers[i].acquisitions;
+    }
+
+    uint64_t *samples = malloc((sample_count ? sample_count : 1) * sizeof(uint64_t));
+    uint64_t filled = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        memcpy(samples + filled, workers[i].samples, workers[i].sample_count * sizeof(uint64_t));
+        filled += workers[i].sample_count;
+    }
+    qsort(samples, sample_count, sizeof(uint64_t), compare_samples);
+    uint64_t p99 = sample_count ? samples[(sample_count - 1) * 99 / 100] : 0;
+
+    int correct = work->check() == 0;
+    int no_leaks = check_no_leaks() == 0;
+
+    printf("%-12s %-7s %7d %14.0f %9.3f %7.3f %10llu %s\n",
+        work->name, use_blocking_lock ? "lock" : "trylock", threads,
+        acquisitions / seconds,
+        acquisitions ? (double)retries / acquisitions : 0.0,
+        sum_squares > 0 ? sum * sum / (threads * sum_squares) : 1.0,
+        (unsigned long long)p99,
+        !correct ? "LOST UPDATE" : !no_leaks ? "LEAKED LOCK" : "ok");
+
+    free(samples);
+    for (int i = 0; i < threads; i++)
+    {
+        free(workers[i].samples);
+    }
+    free(workers);
+    for (int i = 0; i < slot_count; i++)
+    {
+        pthread_mutex_destroy(&slots[i].mutex);
+    }
+    free(slots);
+    return correct && no_leaks ? 0 : -1;
+}
+
+// A trylock that fails on a held mutex must release the ones before it
+// and must not touch the ones after it
+static int check_rollback(void)
+{
+    pthread_mutex_t mutexes[4];
+    for (int i = 0; i < 4; i++)
+    {
+        pthread_mutex_init(&mutexes[i], NULL);
+    }
+    pthread_mutex_t *set[] = { &mutexes[0], &mutexes[1], &mutexes[2], &mutexes[3], NULL };
+
+    pthread_mutex_lock(&mutexes[2]);
+    int result = multi_mutex_trylock(set) == -1 ? 0 : -1;
+    for (int i = 0; i < 4; i++)
+    {
+        if (i == 2)
+        {
+            continue;
+        }
+        if (pthread_mutex_trylock(&mutexes[i]) != 0)
+        {
+            result = -1;
+        }
+        else
+        {
+            pthread_mutex_unlock(&mutexes[i]);
+        }
+    }
+    pthread_mutex_unlock(&mutexes[2]);
+
+    // With nothing held, the whole set is acquired and released
+    if (multi_mutex_trylock(set) != 0 || multi_mutex_unlock(set) != 0)
+    {
+        result = -1;
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        pthread_mutex_destroy(&mutexes[i]);
+    }
+    printf("rollback check: %s\n", result == 0 ? "ok" : "FAILED");
+    return result;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+        "Usage: %s [-t max_threads] [-d duration_ms] [-w workload] [-l]\n"
+        "  workloads: philosophers, transfer, overlap, disjoint (default: all)\n"
+        "  -l uses the blocking multi_mutex_lock instead of retrying trylock\n"
+        "Thread counts are powers of two up to max_threads (default 64), each\n"
+        "run lasts duration_ms milliseconds (default 200).\n",
+        program);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = MAX_BENCH_THREADS;
+    const char *workload_name = NULL;
+    int opt, had_error = 0;
+
+    while ((opt = getopt(argc, argv, "t:d:w:lh")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 'd':
+                duration_ms = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                workload_name = optarg;
+                break;
+            case 'l':
+                use_blocking_lock = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (max_threads < 1 || max_threads > MAX_BENCH_THREADS || duration_ms == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (check_rollback() != 0)
+    {
+        had_error = 1;
+    }
+
+    printf("%-12s %-7s %7s %14s %9s %7s %10s %s\n",
+        "workload", "mode", "threads", "sets/s", "retries", "jain", "p99(ns)", "check");
+
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        if (workload_name && strcmp(workload_name, workloads[w].name) != 0)
+        {
+            continue;
+        }
+        for (int threads = 1; threads <= max_threads; threads *= 2)
+        {
+            if (run_workload(&workloads[w], threads) != 0)
+            {
+                had_error = 1;
+            }
+        }
+    }
+    return had_error ? 1 : 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <stdio.h>
+#include "multi_mutex.h"
+
+// The multi_mutex functions beyond trylock and unlock.
+
+// Blocks until all mutexes of the NULL-terminated arr are held, taking them
+// in address order. Returns -1 if a mutex appears twice or cannot be
+// locked; nothing is held then.
+int multi_mutex_lock(pthread_mutex_t **mutexv);
+
+// Prints the top mutexes by trylock failures, collected by a build with
+// -DMULTI_MUTEX_PROFILE. Without it only a note that profiling is off.
+void multi_mutex_profile_report(FILE *out, int top);
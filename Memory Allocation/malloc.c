@@ -1,22 +1,147 @@
+#define _GNU_SOURCE
 #include "malloc.h"
+#include "malloc_ext.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
+#include <time.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 
 #define ALLOCATED_BLOCK_MAGIC (Block*)(0xbaadf00d)
+#define MAPPED_BLOCK_MAGIC    (Block*)(0xdeadbeef)
 
 /*
- * The heap does not grow.
+ * Requests of at least this many bytes get a mapping of their own, marked
+ * with MAPPED_BLOCK_MAGIC. Their size field is the length of the mapping,
+ * which starts at the page containing the header (the header of an aligned
+ * block is not at the start of the mapping).
  */
-uint8_t __attribute__ ((aligned(HEADER_SIZE))) _heapData[HEAP_SIZE];
+#define MMAP_THRESHOLD (128 * 1024)
 
 /*
- * Point to the first free block in memory.
+ * Blocks up to this size (including the header) are kept in a per-thread
+ * cache when they are freed, instead of going back to the free list.
  */
-Block *_firstFreeBlock;
+#define CACHE_MAX_BLOCK_SIZE 512
+#define CACHE_CLASS_COUNT    (CACHE_MAX_BLOCK_SIZE / HEADER_SIZE)
+
+/*
+ * A size class holding more than CACHE_CLASS_LIMIT blocks hands
+ * CACHE_BATCH_SIZE of them back to the free list under a single lock.
+ * An empty size class is refilled with up to CACHE_BATCH_SIZE blocks.
+ */
+#define CACHE_CLASS_LIMIT 64
+#define CACHE_BATCH_SIZE  32
+
+/*
+ * Cached blocks keep their allocated header. The link to the next cached
+ * block lives in the first data word.
+ */
+#define CACHE_NEXT(block) (*(Block**)&(block)->data[0])
+
+/*
+ * Every thread keeps a magazine of free objects for up to
+ * POOL_MAGAZINE_COUNT pools. A magazine holding more than
+ * POOL_MAGAZINE_LIMIT objects hands POOL_MAGAZINE_BATCH of them back to
+ * the pool under a single lock, an empty one takes up to that many.
+ */
+#define POOL_MAGAZINE_COUNT 4
+#define POOL_MAGAZINE_LIMIT 64
+#define POOL_MAGAZINE_BATCH 32
+
+/*
+ * Free blocks are kept in doubly linked lists. The link to the previous
+ * free block lives in the first data word and the last word of a free
+ * block repeats its size (the footer), so every block needs room for both.
+ */
+#define BIN_PREV(block) (*(Block**)&(block)->data[0])
+#define MIN_BLOCK_SIZE  (2 * HEADER_SIZE)
+
+/*
+ * Block sizes are multiples of 16, so the low bits of the size field are
+ * free for flags. BLOCK_PREV_FREE is set while the physically preceding
+ * block is free, i.e., while the word before the header is its footer.
+ */
+#define BLOCK_PREV_FREE 0x1ULL
+
+/*
+ * The heap grows by mapping additional regions. Every region ends with a
+ * fence: a header of size 0 whose next field points to the region.
+ */
+#define MAX_REGIONS 64
+
+/*
+ * Threads count their my_malloc/my_free calls locally and add them to the
+ * shared counters every STATS_FLUSH_INTERVAL calls (and on exit).
+ */
+#define STATS_FLUSH_INTERVAL 256
+
+/*
+ * One fully free region is kept mapped as a spare, so alternating
+ * malloc/free calls around a region boundary do not map and unmap a region
+ * every time. Its pages are discarded once this many bytes were freed since
+ * the last time, so they do not end up in madvise every time either.
+ */
+#define RELEASE_THRESHOLD (256 * 1024)
+
+/*
+ * Small free blocks are binned by exact size in 16 byte steps (bin i holds
+ * blocks of (i + 1) * 16 bytes). A bit in _smallBinMap is set for every
+ * non-empty bin. Free blocks larger than that are kept in an AVL tree
+ * ordered by size and address.
+ */
+#define SMALL_BIN_COUNT    64
+#define SMALL_BIN_MAX_SIZE (SMALL_BIN_COUNT * HEADER_SIZE)
+
+/*
+ * Tree nodes store their links in the data of the free block instead of
+ * the free list links. The next field of a tree node is NULL.
+ */
+typedef struct _TreeLinks {
+    Block *left;
+    Block *right;
+    int64_t height;
+} TreeLinks;
+
+#define TREE_LINKS(block) ((TreeLinks*)&(block)->data[0])
+
+typedef struct _Region {
+    /*
+     * Start of the mapping. NULL if this entry is unused.
+     */
+    uint8_t *start;
+    /*
+     * Size of the mapping including the fence.
+     */
+    uint64_t size;
+} Region;
+
+/*
+ * The mapped regions of the heap. The table is not part of any mapping so
+ * it can be searched without holding malloc_lock.
+ */
+Region _regions[MAX_REGIONS];
+unsigned _regionCount;
+uint64_t _heapBytes;
+uint64_t _freedSinceRelease;
+static Region *_spareRegion;
+static uint64_t _pageSize;
+
+/*
+ * Free lists for small blocks and the bitmap of non-empty small bins.
+ */
+Block *_smallBins[SMALL_BIN_COUNT];
+uint64_t _smallBinMap;
+
+/*
+ * Root of the tree of free blocks larger than SMALL_BIN_MAX_SIZE.
+ */
+Block *_sizeTree;
 
 /*
  * Locks for concurrency (one for allocation and one for freeing)
@@ -25,29 +150,199 @@ Block *_firstFreeBlock;
 pthread_mutex_t malloc_lock;
 // pthread_mutex_t free_lock;
 
+typedef struct _PoolMagazine {
+    /*
+     * The pool and its serial number, NULL if this magazine is unused. A
+     * magazine whose pool was destroyed is recognized by the serial number
+     * and dropped without touching its objects.
+     */
+    Pool *pool;
+    uint64_t serial;
+    /*
+     * Free objects of the pool, linked through their first word.
+     */
+    void *objects;
+    uint32_t count;
+} PoolMagazine;
+
+typedef struct _ThreadCache {
+    /*
+     * One list of recently freed blocks per size class (16 byte steps).
+     */
+    Block *blocks[CACHE_CLASS_COUNT];
+    uint32_t count[CACHE_CLASS_COUNT];
+    PoolMagazine magazines[POOL_MAGAZINE_COUNT];
+    /*
+     * The heap generation the cached blocks belong to. A cache from before
+     * the last initAllocator() is stale and dropped.
+     */
+    unsigned generation;
+    /*
+     * Set once the cache is registered to be flushed on thread exit.
+     */
+    int registered;
+    /*
+     * Calls not yet added to the shared statistics.
+     */
+    uint64_t allocCount;
+    uint64_t freeCount;
+} ThreadCache;
+
+/*
+ * Free block statistics are only changed with malloc_lock held, the
+ * others with atomic operations.
+ */
+uint64_t _freeBytes;
+uint64_t _freeBlockCount;
+uint64_t _freeBlockHistogram[STATS_HISTOGRAM_BUCKETS];
+uint64_t _mappedBytes;
+uint64_t _allocCount;
+uint64_t _freeCount;
+uint64_t _lockContentions;
+uint64_t _lockWaitNanos;
+
+static __thread ThreadCache _threadCache;
+static pthread_key_t _threadCacheKey;
+static pthread_once_t _threadCacheKeyOnce = PTHREAD_ONCE_INIT;
+static unsigned _heapGeneration;
+
+static void _threadCacheDestructor(void *cache);
+static void _flushMagazines(ThreadCache *cache);
+static void _resetPools(void);
+static Block *_mapRegion(uint64_t minBlockSize);
+static void _freeBlock(Block *block);
+
+static void _createThreadCacheKey(void)
+{
+    pthread_key_create(&_threadCacheKey, _threadCacheDestructor);
+}
 
 /*
  * Initialize the memory block. You don't need to change this.
  */
 void initAllocator()
 {
+    pthread_once(&_threadCacheKeyOnce, _createThreadCacheKey);
     pthread_mutex_init(&malloc_lock, NULL); 
     // pthread_mutex_init(&free_lock, NULL);
-    _firstFreeBlock = (Block*)&_heapData[0];
-    _firstFreeBlock->next = NULL;
-    _firstFreeBlock->size = HEAP_SIZE;
+    _heapGeneration++;
+    _resetPools();
+
+    memset(_smallBins, 0, sizeof(_smallBins));
+    _smallBinMap = 0;
+    _sizeTree = NULL;
+
+    // Drop the regions of a previous heap.
+    for (unsigned i = 0; i < MAX_REGIONS; i++) {
+        if (_regions[i].start != NULL) {
+            munmap(_regions[i].start, _regions[i].size);
+        }
+    }
+    memset(_regions, 0, sizeof(_regions));
+    _regionCount = 0;
+    _spareRegion = NULL;
+    _heapBytes = 0;
+
+    _freeBytes = 0;
+    _freeBlockCount = 0;
+    memset(_freeBlockHistogram, 0, sizeof(_freeBlockHistogram));
+    _mappedBytes = 0;
+    _allocCount = 0;
+    _freeCount = 0;
+    _lockContentions = 0;
+    _lockWaitNanos = 0;
+    _freedSinceRelease = 0;
+    _pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+
+    _mapRegion(HEAP_SIZE - HEADER_SIZE);
+}
+
+/*
+ * Lock malloc_lock, measuring the time spent waiting if it is contended.
+ */
+static void _lockHeap(void)
+{
+    if (pthread_mutex_trylock(&malloc_lock) == 0) {
+        return;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&malloc_lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    const int64_t waited = (int64_t)(end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+    __atomic_fetch_add(&_lockContentions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&_lockWaitNanos, (uint64_t)waited, __ATOMIC_RELAXED);
+}
+
+/*
+ * Get the size of a block without the flag bits.
+ */
+static uint64_t _blockSize(const Block *block)
+{
+    return block->size & INV_HEADER_SIZE_MASK;
 }
 
 /*
  * Get the next block that should start after the current one.
+ * Return NULL at the end of a region.
  */
 static Block *_getNextBlockBySize(const Block *current)
 {
-    static const Block *end = (Block*)&_heapData[HEAP_SIZE];
-    Block *next = (Block*)&current->data[current->size - HEADER_SIZE];
+    Block *next = (Block*)&current->data[_blockSize(current) - HEADER_SIZE];
+
+    return (_blockSize(next) == 0) ? NULL : next;
+}
+
+/*
+ * Get the region that contains the given address, or NULL.
+ */
+static Region *_findRegion(const void *address)
+{
+    for (unsigned i = 0; i < MAX_REGIONS; i++) {
+        const uint8_t *start = _regions[i].start;
+        if ((start != NULL) && ((const uint8_t*)address >= start) &&
+            ((const uint8_t*)address < start + _regions[i].size)) {
+            return &_regions[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Get the offset of a block in its region, for printing.
+ */
+static uintptr_t _regionOffset(const Block *block)
+{
+    const Region *region = _findRegion(block);
+    assert(region != NULL);
+    return (uintptr_t)(void*)block - (uintptr_t)(void*)region->start;
+}
+
+static void _dumpFreeBlock(const Block *block)
+{
+    assert(block->next != ALLOCATED_BLOCK_MAGIC); 
+
+    printf("  Free block starting at %" PRIuPTR " in region %u, size %" PRIu64 "\n",
+        _regionOffset(block),
+        (unsigned)(_findRegion(block) - &_regions[0]),
+        _blockSize(block));
+}
+
+/*
+ * Print the size tree in order, i.e., from the smallest block.
+ */
+static void _dumpTree(const Block *node)
+{
+    if (node == NULL) {
+        return;
+    }
+    assert(node->next == NULL);
 
-    assert(next <= end);
-    return (next == end) ? NULL : next;
+    _dumpTree(TREE_LINKS(node)->left);
+    _dumpFreeBlock(node);
+    _dumpTree(TREE_LINKS(node)->right);
 }
 
 /*
@@ -58,34 +353,44 @@ void dumpAllocator()
 {
     Block *current;
 
-    pthread_mutex_lock(&malloc_lock);
+    _lockHeap();
     // pthread_mutex_lock(&free_lock);
 
     printf("All blocks:\n");
-    current = (Block*)&_heapData[0]; //first block
-    while (current) {
-        assert((current->size & INV_HEADER_SIZE_MASK) == current->size);
-        assert(current->size > 0);
+    for (unsigned i = 0; i < MAX_REGIONS; i++) {
+        if (_regions[i].start == NULL) {
+            continue;
+        }
+        printf(" Region %u, size %" PRIu64 "\n", i, _regions[i].size);
 
-        printf("  Block starting at %" PRIuPTR ", size %" PRIu64 " (%s)\n",
-            ((uintptr_t)(void*)current - (uintptr_t)(void*)&_heapData[0]),
-            current->size,
-            (current->next == ALLOCATED_BLOCK_MAGIC) ? "allocated" : "free");
+        current = (Block*)_regions[i].start; //first block
+        int prevFree = 0;
+        while (current) {
+            assert((current->size & ~INV_HEADER_SIZE_MASK & ~BLOCK_PREV_FREE) == 0);
+            assert(_blockSize(current) > 0);
+            assert(((current->size & BLOCK_PREV_FREE) != 0) == prevFree);
 
-        current = _getNextBlockBySize(current);
-    }
+            printf("  Block starting at %" PRIuPTR ", size %" PRIu64 " (%s)\n",
+                _regionOffset(current),
+                _blockSize(current),
+                (current->next == ALLOCATED_BLOCK_MAGIC) ? "allocated" : "free");
 
-    printf("Current free block list:\n");
-    current = _firstFreeBlock;
-    while (current) {
-        assert(current->next != ALLOCATED_BLOCK_MAGIC); 
+            prevFree = (current->next != ALLOCATED_BLOCK_MAGIC);
+            current = _getNextBlockBySize(current);
+        }
+    }
 
-        printf("  Free block starting at %" PRIuPTR ", size %" PRIu64 "\n",
-            ((uintptr_t)(void*)current - (uintptr_t)(void*)&_heapData[0]),
-            current->size);
+    printf("Current free block lists:\n");
+    for (unsigned bin = 0; bin < SMALL_BIN_COUNT; bin++) {
+        current = _smallBins[bin];
+        assert(((_smallBinMap >> bin) & 1) == (current != NULL));
 
-        current = current->next;
+        while (current) {
+            _dumpFreeBlock(current);
+            current = current->next;
+        }
     }
+    _dumpTree(_sizeTree);
     pthread_mutex_unlock(&malloc_lock);
     // pthread_mutex_unlock(&free_lock);
 }
@@ -98,154 +403,1235 @@ uint64_t roundUp(uint64_t n)
     return (n + HEADER_SIZE - 1) & INV_HEADER_SIZE_MASK;
 }
 
-static void *_allocate(Block **blockLink, uint64_t size)
+/*
+ * Repeat the size of a free block in its last word.
+ */
+static void _setFooter(Block *block)
 {
-    assert(blockLink != NULL);
-    assert((size & INV_HEADER_SIZE_MASK) == size);
-    assert(size >= HEADER_SIZE);
+    const uint64_t size = _blockSize(block);
+    *(uint64_t*)((uint8_t*)block + size - sizeof(uint64_t)) = size;
+}
 
-    pthread_mutex_lock(&malloc_lock);
+/*
+ * Compare two tree nodes by size, and by address for blocks of equal size.
+ */
+static int _treeLess(const Block *a, const Block *b)
+{
+    if (_blockSize(a) != _blockSize(b)) {
+        return _blockSize(a) < _blockSize(b);
+    }
+    return a < b;
+}
 
-    Block *freeBlock = *blockLink;
-    assert(freeBlock != NULL);
-    assert(freeBlock->size >= size);
+static int64_t _treeHeight(const Block *node)
+{
+    return (node == NULL) ? 0 : TREE_LINKS(node)->height;
+}
 
-    if (freeBlock->size == size) {
-        // The selected free block exactly fits the requested size. No need to split the block.
-        *blockLink = freeBlock->next;
-    } else {
-        // The free block is larger. Split it into two blocks. One allocated that is returned to the caller and a new free one.
-        const uint64_t remainingSize = freeBlock->size - size;
-        assert((remainingSize & INV_HEADER_SIZE_MASK) == remainingSize);
-        assert(remainingSize >= HEADER_SIZE);
+static void _treeUpdateHeight(Block *node)
+{
+    const int64_t left  = _treeHeight(TREE_LINKS(node)->left);
+    const int64_t right = _treeHeight(TREE_LINKS(node)->right);
+
+    TREE_LINKS(node)->height = 1 + ((left > right) ? left : right);
+}
+
+static Block *_treeRotateRight(Block *node)
+{
+    Block *left = TREE_LINKS(node)->left;
+
+    TREE_LINKS(node)->left = TREE_LINKS(left)->right;
+    TREE_LINKS(left)->right = node;
+    _treeUpdateHeight(node);
+    _treeUpdateHeight(left);
+    return left;
+}
+
+static Block *_treeRotateLeft(Block *node)
+{
+    Block *right = TREE_LINKS(node)->right;
+
+    TREE_LINKS(node)->right = TREE_LINKS(right)->left;
+    TREE_LINKS(right)->left = node;
+    _treeUpdateHeight(node);
+    _treeUpdateHeight(right);
+    return right;
+}
+
+/*
+ * Restore the AVL property of a subtree whose children differ in height
+ * by at most two. Return the new root of the subtree.
+ */
+static Block *_treeBalance(Block *node)
+{
+    TreeLinks *links = TREE_LINKS(node);
+    const int64_t balance = _treeHeight(links->left) - _treeHeight(links->right);
+
+    if (balance > 1) {
+        if (_treeHeight(TREE_LINKS(links->left)->left) < _treeHeight(TREE_LINKS(links->left)->right)) {
+            links->left = _treeRotateLeft(links->left);
+        }
+        return _treeRotateRight(node);
+    }
+    if (balance < -1) {
+        if (_treeHeight(TREE_LINKS(links->right)->right) < _treeHeight(TREE_LINKS(links->right)->left)) {
+            links->right = _treeRotateRight(links->right);
+        }
+        return _treeRotateLeft(node);
+    }
 
-        freeBlock->size = size;
+    _treeUpdateHeight(node);
+    return node;
+}
 
-        Block *newFreeBlock = _getNextBlockBySize(freeBlock);
-        newFreeBlock->size  = remainingSize;
-        newFreeBlock->next  = freeBlock->next;
-        *blockLink = newFreeBlock;
+static Block *_treeInsert(Block *root, Block *block)
+{
+    if (root == NULL) {
+        TREE_LINKS(block)->left   = NULL;
+        TREE_LINKS(block)->right  = NULL;
+        TREE_LINKS(block)->height = 1;
+        return block;
     }
 
-    // Mark the current block as allocated by setting a magic next value
-    freeBlock->next = ALLOCATED_BLOCK_MAGIC;
+    if (_treeLess(block, root)) {
+        TREE_LINKS(root)->left = _treeInsert(TREE_LINKS(root)->left, block);
+    } else {
+        TREE_LINKS(root)->right = _treeInsert(TREE_LINKS(root)->right, block);
+    }
+    return _treeBalance(root);
+}
 
-    pthread_mutex_unlock(&malloc_lock);
+/*
+ * Unlink the smallest node of a subtree and store it in min.
+ */
+static Block *_treeRemoveMin(Block *root, Block **min)
+{
+    if (TREE_LINKS(root)->left == NULL) {
+        *min = root;
+        return TREE_LINKS(root)->right;
+    }
 
-    return &freeBlock->data[0];
+    TREE_LINKS(root)->left = _treeRemoveMin(TREE_LINKS(root)->left, min);
+    return _treeBalance(root);
 }
 
-void *my_malloc(uint64_t size)
+static Block *_treeRemove(Block *root, Block *block)
 {
+    assert(root != NULL);
 
-    pthread_mutex_lock(&malloc_lock); // do lock because different processes might be requesting the same block. In order to avoid this overlap, lock in this function as well
-    // Calculate the minimum size of the free block we need to find.
-    // We only allocate blocks that are multiples of 16 bytes in size, so we
-    // round up the requested size. This potentially wastes some memory but
-    // makes management easier. We also need to store our block header.
-    const uint64_t requestedSize = roundUp(size) + HEADER_SIZE;
-    Block *current = _firstFreeBlock;
-    Block **link   = &_firstFreeBlock; //address of the pointer, or pointer to a pointer
-
-    uint64_t bestSize = 0;
-    Block *bestBlock = NULL;
-    Block **bestLink = NULL;
-    while (current) {
-        if (current->size >= requestedSize ) {
-            if(bestBlock==NULL || current->size<bestSize) {
-		// Either we are a better fit, or we don't have 
-		bestSize = current->size;
-		bestBlock = current;
-		bestLink = link; //address of the "".next" attribute of the prev block
-		// testing first fit:
-		break;
-	    } 
-        }
-        link = &current->next;
-        current = current->next;
+    if (root == block) {
+        Block *left  = TREE_LINKS(root)->left;
+        Block *right = TREE_LINKS(root)->right;
+        if (right == NULL) {
+            return left;
+        }
+
+        // Replace the node by its successor.
+        Block *successor;
+        right = _treeRemoveMin(right, &successor);
+        TREE_LINKS(successor)->left  = left;
+        TREE_LINKS(successor)->right = right;
+        return _treeBalance(successor);
     }
-    pthread_mutex_unlock(&malloc_lock);
 
-    // We did not find a free block that offers enough space. Return NULL to
-    // indicate that the allocation failed.
-    if( bestBlock == NULL ) {
-	printf("Out of memory\n");
-	return NULL;
+    if (_treeLess(block, root)) {
+        TREE_LINKS(root)->left = _treeRemove(TREE_LINKS(root)->left, block);
+    } else {
+        TREE_LINKS(root)->right = _treeRemove(TREE_LINKS(root)->right, block);
+    }
+    return _treeBalance(root);
+}
+
+/*
+ * Get the smallest tree node of at least the given size, i.e., the best
+ * fit. Among blocks of the same size this is the one with the lowest
+ * address.
+ */
+static Block *_treeFindBestFit(uint64_t size)
+{
+    Block *node = _sizeTree;
+    Block *best = NULL;
+
+    while (node) {
+        if (_blockSize(node) >= size) {
+            best = node;
+            node = TREE_LINKS(node)->left;
+        } else {
+            node = TREE_LINKS(node)->right;
+        }
     }
+    return best;
+}
 
-    return _allocate(bestLink, requestedSize);
+static unsigned _histogramBucket(uint64_t size)
+{
+    const unsigned bucket = 63 - __builtin_clzll(size) - 5;
+    return (bucket < STATS_HISTOGRAM_BUCKETS) ? bucket : STATS_HISTOGRAM_BUCKETS - 1;
 }
 
 /*
- * Check if we can merge this block with the next one.
+ * Add a free block to its bin. Must be called with malloc_lock held.
  */
-static void _tryMerge(Block *freeBlock)
+static void _insertFreeBlock(Block *block)
 {
-    assert(freeBlock != NULL);
-    assert(freeBlock->next != ALLOCATED_BLOCK_MAGIC);  //why?
+    const uint64_t size = _blockSize(block);
+    assert(size >= MIN_BLOCK_SIZE);
 
-    // If there is no free block after the given one, there
-    // is nothing we can merge.
-    if (freeBlock->next == NULL) {  //end of the free list
+    _freeBytes += size;
+    _freeBlockCount++;
+    _freeBlockHistogram[_histogramBucket(size)]++;
+
+    if (size > SMALL_BIN_MAX_SIZE) {
+        block->next = NULL;
+        _sizeTree = _treeInsert(_sizeTree, block);
         return;
     }
 
-    // Look at the next block in the heap. If it is linked with the free block
-    // it is also free and we can merge the blocks.
-    const Block *next = _getNextBlockBySize(freeBlock);
-
-    if (next == freeBlock->next) { //checking that it is contiguous
-        assert(next->next != ALLOCATED_BLOCK_MAGIC);
+    Block **bin = &_smallBins[size / HEADER_SIZE - 1];
 
-        freeBlock->size += next->size;
-        freeBlock->next = next->next;
+    block->next = *bin;
+    BIN_PREV(block) = NULL;
+    if (*bin != NULL) {
+        BIN_PREV(*bin) = block;
     }
+    *bin = block;
+
+    _smallBinMap |= 1ULL << (size / HEADER_SIZE - 1);
 }
 
-void my_free(void *address)
+/*
+ * Remove a free block from its bin. Must be called with malloc_lock held.
+ */
+static void _removeFreeBlock(Block *block)
 {
+    assert(block->next != ALLOCATED_BLOCK_MAGIC);
 
-    // pthread_mutex_lock(&free_lock);
-    pthread_mutex_lock(&malloc_lock);
+    const uint64_t size = _blockSize(block);
 
-    if (address == NULL) {
+    _freeBytes -= size;
+    _freeBlockCount--;
+    _freeBlockHistogram[_histogramBucket(size)]--;
+
+    if (size > SMALL_BIN_MAX_SIZE) {
+        _sizeTree = _treeRemove(_sizeTree, block);
         return;
     }
-    // Making sure it is within bounds
-    assert(address >= (void*)&_heapData[0]);  // greatoreq than the address of the first block in the heap 
-    assert(address <= (void*)&_heapData[HEAP_SIZE]); //lessoreq than the address of the last block in the heap
 
-    // We first need to get the block header for the given address.
-    // address should point to the beginning of the block's data segment,
-    // directly after the header -> decrement address by one header size.
-    Block *block = (Block*)(address) - 1;  // common when operating with pointers that +- 1 is the prev or next pointer (it uses the size of the data type being manipulated). Void pointer address is casted as a block type pointer
+    Block **bin = &_smallBins[size / HEADER_SIZE - 1];
+
+    if (BIN_PREV(block) != NULL) {
+        BIN_PREV(block)->next = block->next;
+    } else {
+        assert(*bin == block);
+        *bin = block->next;
+    }
+    if (block->next != NULL) {
+        BIN_PREV(block->next) = BIN_PREV(block);
+    }
+
+    if (*bin == NULL) {
+        _smallBinMap &= ~(1ULL << (size / HEADER_SIZE - 1));
+    }
+}
+
+/*
+ * Shrink an allocated block to the given size. If the rest is large enough
+ * for a block of its own, it is split off and freed; otherwise it stays part
+ * of the allocated block. Must be called with malloc_lock held.
+ */
+static void _splitTail(Block *block, uint64_t size)
+{
     assert(block->next == ALLOCATED_BLOCK_MAGIC);
+    assert(_blockSize(block) >= size);
 
-    Block *freeBlock = _firstFreeBlock;
+    const uint64_t remainingSize = _blockSize(block) - size;
+    if (remainingSize >= MIN_BLOCK_SIZE) {
+        assert((remainingSize & INV_HEADER_SIZE_MASK) == remainingSize);
 
-    // The free block must be inserted at the correct position in the free list
-    // to allow merging with the neighbor blocks in the case they are free, too
-    // We can find the correct position easily, by comparing the block addresses
-    if ((freeBlock == NULL) || (freeBlock > block)) {
-        // Insert the block at the front of the freelist
-        _firstFreeBlock = block;
-        block->next = freeBlock;
+        block->size = size | (block->size & BLOCK_PREV_FREE);
 
-        _tryMerge(block);
+        Block *tail = (Block*)((uint8_t*)block + size);
+        tail->next = ALLOCATED_BLOCK_MAGIC;
+        tail->size = remainingSize;
+        _freeBlock(tail);
     } else {
-        // Iterate the free list until we reach its end or find the correct pos
-        while ((freeBlock->next != NULL) && (freeBlock->next < block)) {
-            freeBlock = freeBlock->next;
+        Block *next = _getNextBlockBySize(block);
+        if (next != NULL) {
+            next->size &= ~BLOCK_PREV_FREE;
         }
+    }
+}
+
+/*
+ * Must be called with malloc_lock held.
+ */
+static void *_allocate(Block *freeBlock, uint64_t size)
+{
+    assert(freeBlock != NULL);
+    assert((size & INV_HEADER_SIZE_MASK) == size);
+    assert(size >= MIN_BLOCK_SIZE);
+    assert(_blockSize(freeBlock) >= size);
 
-        // Insert block into free list and try to merge with neighbor blocks
-        block->next = freeBlock->next;
-        freeBlock->next = block;
+    _removeFreeBlock(freeBlock);
 
-        _tryMerge(block);
-        _tryMerge(freeBlock);
+    // Mark the current block as allocated by setting a magic next value
+    freeBlock->next = ALLOCATED_BLOCK_MAGIC;
+
+    _splitTail(freeBlock, size);
+
+    return &freeBlock->data[0];
+}
+
+/*
+ * Find the smallest free block of at least the given size.
+ * Return NULL if there is none. Must be called with malloc_lock held.
+ */
+static Block *_findFreeBlock(uint64_t requestedSize)
+{
+    // Every small bin holds blocks of exactly one size, so the first
+    // non-empty bin at or above the requested size is the best fit.
+    if (requestedSize <= SMALL_BIN_MAX_SIZE) {
+        const uint64_t fittingBins = _smallBinMap & (~0ULL << (requestedSize / HEADER_SIZE - 1));
+        if (fittingBins != 0) {
+            return _smallBins[__builtin_ctzll(fittingBins)];
+        }
     }
 
-    // pthread_mutex_unlock(&free_lock);
-    pthread_mutex_unlock(&malloc_lock);
+    return _treeFindBestFit(requestedSize);
+}
+
+/*
+ * Merge a block with its physical neighbours if they are free. The given
+ * block must not be in a bin; merged neighbours are removed from theirs.
+ * Return the start of the merged block.
+ */
+static Block *_tryMerge(Block *freeBlock)
+{
+    assert(freeBlock != NULL);
+
+    // Look at the next block in the heap. If it is not marked as allocated
+    // it is on a free list and we can merge the blocks.
+    Block *next = _getNextBlockBySize(freeBlock);
+
+    if ((next != NULL) && (next->next != ALLOCATED_BLOCK_MAGIC)) {
+        _removeFreeBlock(next);
+        freeBlock->size += _blockSize(next);
+    }
+
+    // The footer of a free previous block tells us where it starts.
+    if (freeBlock->size & BLOCK_PREV_FREE) {
+        const uint64_t prevSize = ((const uint64_t*)freeBlock)[-1];
+        Block *prev = (Block*)((uint8_t*)freeBlock - prevSize);
+        assert(_blockSize(prev) == prevSize);
+
+        _removeFreeBlock(prev);
+        prev->size += _blockSize(freeBlock);
+        freeBlock = prev;
+    }
+
+    return freeBlock;
+}
+
+/*
+ * Map a new region with room for a free block of at least the given size
+ * and put that block into its bin. Regions grow with the heap, so the
+ * number of regions stays small. Return NULL if no memory can be mapped.
+ * Must be called with malloc_lock held (or from initAllocator).
+ */
+static Block *_mapRegion(uint64_t minBlockSize)
+{
+    Region *region = NULL;
+    for (unsigned i = 0; (i < MAX_REGIONS) && (region == NULL); i++) {
+        if (_regions[i].start == NULL) {
+            region = &_regions[i];
+        }
+    }
+    if (region == NULL) {
+        return NULL;
+    }
+
+    uint64_t size = minBlockSize + HEADER_SIZE;
+    if (size < _heapBytes) {
+        size = _heapBytes;
+    }
+    size = (size + _pageSize - 1) & ~(_pageSize - 1);
+
+    void *start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED) {
+        return NULL;
+    }
+
+    region->start = start;
+    region->size  = size;
+    _regionCount++;
+    _heapBytes += size;
+
+    Block *fence = (Block*)(region->start + size - HEADER_SIZE);
+    fence->next = (Block*)region;
+    fence->size = 0;
+
+    Block *block = (Block*)region->start;
+    block->size = size - HEADER_SIZE;
+    _setFooter(block);
+    _insertFreeBlock(block);
+
+    return block;
+}
+
+/*
+ * Return 1 if the region consists of a single free block.
+ */
+static int _isRegionEmpty(const Region *region)
+{
+    const Block *block = (const Block*)region->start;
+    return (block->next != ALLOCATED_BLOCK_MAGIC) && (_blockSize(block) == region->size - HEADER_SIZE);
+}
+
+/*
+ * Hand the memory of a free block that spans its whole region back to the
+ * OS. The region is unmapped if another region is already empty, otherwise
+ * it becomes the spare region and its pages are only discarded (see
+ * RELEASE_THRESHOLD). Return 1 if the region was unmapped.
+ * Must be called with malloc_lock held.
+ */
+static int _releaseRegion(Block *block)
+{
+    const Block *fence = (const Block*)((uint8_t*)block + _blockSize(block));
+    if (_blockSize(fence) != 0) {
+        return 0;
+    }
+
+    Region *region = (Region*)fence->next;
+    if ((uint8_t*)block != region->start) {
+        return 0;
+    }
+
+    if ((_spareRegion != NULL) && (_spareRegion != region) && _isRegionEmpty(_spareRegion)) {
+        // The block never went into a bin.
+        munmap(region->start, region->size);
+        _heapBytes -= region->size;
+        _regionCount--;
+        region->start = NULL;
+        region->size  = 0;
+        return 1;
+    }
+    _spareRegion = region;
+
+    if (_freedSinceRelease < RELEASE_THRESHOLD) {
+        return 0;
+    }
+    _freedSinceRelease = 0;
+
+    // Keep the header, the free list link and the footer resident.
+    const uintptr_t first = ((uintptr_t)&block->data[sizeof(Block*)] + _pageSize - 1) & ~(_pageSize - 1);
+    const uintptr_t last  = ((uintptr_t)fence - sizeof(uint64_t)) & ~(_pageSize - 1);
+    if (first < last) {
+        madvise((void*)first, last - first, MADV_DONTNEED);
+    }
+    return 0;
+}
+
+/*
+ * Put an allocated block back on the free list, merged with its free
+ * neighbours. Must be called with malloc_lock held.
+ */
+static void _freeBlock(Block *block)
+{
+    assert(block->next == ALLOCATED_BLOCK_MAGIC);
+
+    _freedSinceRelease += _blockSize(block);
+
+    block = _tryMerge(block);
+    if (_releaseRegion(block)) {
+        return;
+    }
+    _setFooter(block);
+
+    Block *next = _getNextBlockBySize(block);
+    if (next != NULL) {
+        next->size |= BLOCK_PREV_FREE;
+    }
+
+    _insertFreeBlock(block);
+}
+
+static void _registerThreadCache(ThreadCache *cache)
+{
+    if (!cache->registered) {
+        // The destructor only runs for non-NULL values.
+        pthread_setspecific(_threadCacheKey, cache);
+        cache->registered = 1;
+    }
+}
+
+/*
+ * Get the cache of the calling thread, dropping it if it belongs to an
+ * earlier heap.
+ */
+static ThreadCache *_getThreadCache(void)
+{
+    ThreadCache *cache = &_threadCache;
+
+    if (cache->generation != _heapGeneration) {
+        memset(cache->blocks, 0, sizeof(cache->blocks));
+        memset(cache->count, 0, sizeof(cache->count));
+        memset(cache->magazines, 0, sizeof(cache->magazines));
+        cache->generation = _heapGeneration;
+    }
+    _registerThreadCache(cache);
+    return cache;
+}
+
+/*
+ * Count a call of my_malloc (isFree = 0) or my_free (isFree = 1).
+ */
+static void _countCall(int isFree)
+{
+    ThreadCache *cache = &_threadCache;
+    uint64_t *count = isFree ? &cache->freeCount : &cache->allocCount;
+
+    if (++(*count) >= STATS_FLUSH_INTERVAL) {
+        __atomic_fetch_add(isFree ? &_freeCount : &_allocCount, *count, __ATOMIC_RELAXED);
+        *count = 0;
+        _registerThreadCache(cache);
+    }
+}
+
+static unsigned _cacheClass(uint64_t size)
+{
+    return (unsigned)(size / HEADER_SIZE) - 1;
+}
+
+static int _isCacheable(uint64_t size)
+{
+    return size <= CACHE_MAX_BLOCK_SIZE;
+}
+
+/*
+ * Return up to count blocks of a size class to the free list.
+ */
+static void _flushCacheClass(ThreadCache *cache, unsigned sizeClass, uint32_t count)
+{
+    _lockHeap();
+    while ((count > 0) && (cache->blocks[sizeClass] != NULL)) {
+        Block *block = cache->blocks[sizeClass];
+        cache->blocks[sizeClass] = CACHE_NEXT(block);
+        cache->count[sizeClass]--;
+        count--;
+
+        _freeBlock(block);
+    }
+    pthread_mutex_unlock(&malloc_lock);
+}
+
+/*
+ * Return all cached blocks of a thread to the free list.
+ */
+static void _flushCache(ThreadCache *cache)
+{
+    if (cache->generation != _heapGeneration) {
+        return;
+    }
+    for (unsigned sizeClass = 0; sizeClass < CACHE_CLASS_COUNT; sizeClass++) {
+        if (cache->blocks[sizeClass] != NULL) {
+            _flushCacheClass(cache, sizeClass, cache->count[sizeClass]);
+        }
+    }
+}
+
+static void _threadCacheDestructor(void *cache)
+{
+    ThreadCache *threadCache = (ThreadCache*)cache;
+
+    _flushMagazines(threadCache);
+    _flushCache(threadCache);
+    __atomic_fetch_add(&_allocCount, threadCache->allocCount, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&_freeCount, threadCache->freeCount, __ATOMIC_RELAXED);
+    threadCache->allocCount = 0;
+    threadCache->freeCount  = 0;
+    threadCache->registered = 0;
+}
+
+/*
+ * Allocate a block for an empty size class. Up to CACHE_BATCH_SIZE - 1
+ * additional blocks of the same size are put into the cache.
+ */
+static void *_refillCache(ThreadCache *cache, uint64_t size)
+{
+    const unsigned sizeClass = _cacheClass(size);
+    void *result = NULL;
+
+    _lockHeap();
+    for (int i = 0; i < CACHE_BATCH_SIZE; i++) {
+        Block *freeBlock = _findFreeBlock(size);
+        if (freeBlock == NULL) {
+            break;
+        }
+
+        void *data = _allocate(freeBlock, size);
+        if (result == NULL) {
+            result = data;
+        } else {
+            Block *block = (Block*)data - 1;
+            CACHE_NEXT(block) = cache->blocks[sizeClass];
+            cache->blocks[sizeClass] = block;
+            cache->count[sizeClass]++;
+        }
+    }
+    pthread_mutex_unlock(&malloc_lock);
+
+    return result;
+}
+
+/*
+ * Serve a large request from its own mapping. Does not need malloc_lock.
+ */
+static void *_allocateMapped(uint64_t size)
+{
+    if (size > UINT64_MAX - HEADER_SIZE - _pageSize) {
+        return NULL;
+    }
+    const uint64_t mappedSize = (size + HEADER_SIZE + _pageSize - 1) & ~(_pageSize - 1);
+
+    Block *block = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+
+    block->next = MAPPED_BLOCK_MAGIC;
+    block->size = mappedSize;
+    __atomic_fetch_add(&_mappedBytes, mappedSize, __ATOMIC_RELAXED);
+    return &block->data[0];
+}
+
+/*
+ * Get the start of the mapping of a block with MAPPED_BLOCK_MAGIC.
+ */
+static uint8_t *_mappingStart(const Block *block)
+{
+    return (uint8_t*)((uintptr_t)block & ~(_pageSize - 1));
+}
+
+/*
+ * Get the number of bytes the caller may use in an allocated block.
+ */
+static uint64_t _usableSize(const Block *block)
+{
+    if (block->next == MAPPED_BLOCK_MAGIC) {
+        return block->size - (uint64_t)((const uint8_t*)&block->data[0] - _mappingStart(block));
+    }
+    return _blockSize(block) - HEADER_SIZE;
+}
+
+/*
+ * Get the block size for a request of size bytes.
+ */
+static uint64_t _requestedBlockSize(uint64_t size)
+{
+    // Calculate the minimum size of the free block we need to find.
+    // We only allocate blocks that are multiples of 16 bytes in size, so we
+    // round up the requested size. This potentially wastes some memory but
+    // makes management easier. We also need to store our block header.
+    // Every block must be able to hold the free list links once it is freed.
+    uint64_t requestedSize = roundUp(size) + HEADER_SIZE;
+    if (requestedSize < MIN_BLOCK_SIZE) {
+        requestedSize = MIN_BLOCK_SIZE;
+    }
+    return requestedSize;
+}
+
+void *my_malloc(uint64_t size)
+{
+    _countCall(0);
+
+    // Large buffers never fragment the heap.
+    if (size >= MMAP_THRESHOLD) {
+        return _allocateMapped(size);
+    }
+
+    const uint64_t requestedSize = _requestedBlockSize(size);
+
+    // Small requests are served from the thread's cache without locking.
+    if (_isCacheable(requestedSize)) {
+        ThreadCache *cache = _getThreadCache();
+        const unsigned sizeClass = _cacheClass(requestedSize);
+        Block *block = cache->blocks[sizeClass];
+
+        if (block != NULL) {
+            cache->blocks[sizeClass] = CACHE_NEXT(block);
+            cache->count[sizeClass]--;
+            return &block->data[0];
+        }
+
+        void *result = _refillCache(cache, requestedSize);
+        if (result != NULL) {
+            return result;
+        }
+    }
+
+    _lockHeap(); // do lock because different processes might be requesting the same block. In order to avoid this overlap, lock in this function as well
+    Block *bestBlock = _findFreeBlock(requestedSize);
+    if (bestBlock == NULL) {
+        pthread_mutex_unlock(&malloc_lock);
+
+        // The blocks cached by this thread might be enough to satisfy the
+        // request once they are merged back into the free list.
+        _flushCache(_getThreadCache());
+
+        _lockHeap();
+        bestBlock = _findFreeBlock(requestedSize);
+    }
+    if (bestBlock == NULL) {
+        // Grow the heap.
+        bestBlock = _mapRegion(requestedSize);
+    }
+
+    // We did not find a free block that offers enough space. Return NULL to
+    // indicate that the allocation failed.
+    if( bestBlock == NULL ) {
+	pthread_mutex_unlock(&malloc_lock);
+	printf("Out of memory\n");
+	return NULL;
+    }
+
+    void *result = _allocate(bestBlock, requestedSize);
+    pthread_mutex_unlock(&malloc_lock);
+    return result;
+}
+
+void my_free(void *address)
+{
+    if (address == NULL) {
+        return;
+    }
+    _countCall(1);
+
+    // We first need to get the block header for the given address.
+    // address should point to the beginning of the block's data segment,
+    // directly after the header -> decrement address by one header size.
+    Block *block = (Block*)(address) - 1;  // common when operating with pointers that +- 1 is the prev or next pointer (it uses the size of the data type being manipulated). Void pointer address is casted as a block type pointer
+
+    // Blocks with a mapping of their own go straight back to the OS.
+    if (block->next == MAPPED_BLOCK_MAGIC) {
+        assert(_findRegion(address) == NULL);
+        __atomic_fetch_sub(&_mappedBytes, block->size, __ATOMIC_RELAXED);
+        munmap(_mappingStart(block), block->size);
+        return;
+    }
+
+    // Making sure it is within the bounds of one of the heap regions
+    assert(_findRegion(address) != NULL);
+    assert(block->next == ALLOCATED_BLOCK_MAGIC);
+
+    // Small blocks stay in the thread's cache. Only when a size class grows
+    // too large a batch of them goes back to the free list.
+    if (_isCacheable(_blockSize(block))) {
+        ThreadCache *cache = _getThreadCache();
+        const unsigned sizeClass = _cacheClass(_blockSize(block));
+
+        CACHE_NEXT(block) = cache->blocks[sizeClass];
+        cache->blocks[sizeClass] = block;
+        if (++cache->count[sizeClass] > CACHE_CLASS_LIMIT) {
+            _flushCacheClass(cache, sizeClass, CACHE_BATCH_SIZE);
+        }
+        return;
+    }
+
+    // pthread_mutex_lock(&free_lock);
+    _lockHeap();
+
+    _freeBlock(block);
+
+    // pthread_mutex_unlock(&free_lock);
+    pthread_mutex_unlock(&malloc_lock);
+}
+
+/*
+ * Resize an allocation. Heap blocks shrink in place by splitting off their
+ * tail and grow in place by absorbing the following block if it is free.
+ * Only if that is not possible the data is moved to a new allocation.
+ */
+void *my_realloc(void *address, uint64_t size)
+{
+    if (address == NULL) {
+        return my_malloc(size);
+    }
+    if (size == 0) {
+        my_free(address);
+        return NULL;
+    }
+
+    Block *block = (Block*)(address) - 1;
+
+    if (block->next == MAPPED_BLOCK_MAGIC) {
+        // Let the kernel move the pages if the block stays large.
+        if ((size >= MMAP_THRESHOLD) && (_mappingStart(block) == (uint8_t*)block) &&
+            (size <= UINT64_MAX - HEADER_SIZE - _pageSize)) {
+            const uint64_t mappedSize = (size + HEADER_SIZE + _pageSize - 1) & ~(_pageSize - 1);
+
+            const uint64_t oldSize = block->size;
+            Block *moved = mremap(block, oldSize, mappedSize, MREMAP_MAYMOVE);
+            if (moved == MAP_FAILED) {
+                return NULL;
+            }
+            moved->size = mappedSize;
+            __atomic_fetch_add(&_mappedBytes, mappedSize - oldSize, __ATOMIC_RELAXED);
+            return &moved->data[0];
+        }
+    } else if (size < MMAP_THRESHOLD) {
+        assert(_findRegion(address) != NULL);
+        assert(block->next == ALLOCATED_BLOCK_MAGIC);
+
+        const uint64_t requestedSize = _requestedBlockSize(size);
+
+        _lockHeap();
+
+        Block *next = _getNextBlockBySize(block);
+        if ((_blockSize(block) < requestedSize) && (next != NULL) &&
+            (next->next != ALLOCATED_BLOCK_MAGIC) &&
+            (_blockSize(block) + _blockSize(next) >= requestedSize)) {
+            _removeFreeBlock(next);
+            block->size += _blockSize(next);
+        }
+
+        if (_blockSize(block) >= requestedSize) {
+            _splitTail(block, requestedSize);
+            pthread_mutex_unlock(&malloc_lock);
+            return address;
+        }
+
+        pthread_mutex_unlock(&malloc_lock);
+    }
+
+    void *moved = my_malloc(size);
+    if (moved == NULL) {
+        return NULL;
+    }
+
+    const uint64_t usableSize = _usableSize(block);
+    memcpy(moved, address, (usableSize < size) ? usableSize : size);
+    my_free(address);
+    return moved;
+}
+
+/*
+ * Allocate a large block aligned to the given power of two from a mapping
+ * of its own. The mapping is trimmed so that it starts at the page of the
+ * header and ends at the page of the last byte.
+ */
+static void *_allocateMappedAligned(uint64_t alignment, uint64_t size)
+{
+    if ((size > UINT64_MAX / 2) || (alignment > UINT64_MAX / 4)) {
+        return NULL;
+    }
+    const uint64_t slack      = (alignment > _pageSize) ? alignment : _pageSize;
+    const uint64_t mappedSize = ((size + _pageSize - 1) & ~(_pageSize - 1)) + slack + _pageSize;
+
+    uint8_t *start = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+
+    uint8_t *data  = (uint8_t*)(((uintptr_t)start + HEADER_SIZE + alignment - 1) & ~(alignment - 1));
+    Block *block   = (Block*)data - 1;
+    uint8_t *first = _mappingStart(block);
+    uint8_t *end   = (uint8_t*)(((uintptr_t)data + size + _pageSize - 1) & ~(_pageSize - 1));
+
+    if (first > start) {
+        munmap(start, (uint64_t)(first - start));
+    }
+    if (end < start + mappedSize) {
+        munmap(end, (uint64_t)(start + mappedSize - end));
+    }
+
+    block->next = MAPPED_BLOCK_MAGIC;
+    block->size = (uint64_t)(end - first);
+    __atomic_fetch_add(&_mappedBytes, block->size, __ATOMIC_RELAXED);
+    _countCall(0);
+    return data;
+}
+
+/*
+ * Allocate size bytes at an address that is a multiple of alignment, which
+ * must be a power of two. The result is freed with my_free.
+ */
+void *my_aligned_alloc(uint64_t alignment, uint64_t size)
+{
+    if ((alignment == 0) || ((alignment & (alignment - 1)) != 0)) {
+        return NULL;
+    }
+    if (alignment <= HEADER_SIZE) {
+        return my_malloc(size);
+    }
+    if ((size > UINT64_MAX / 2) || (alignment > UINT64_MAX / 4) ||
+        (size + alignment + MIN_BLOCK_SIZE >= MMAP_THRESHOLD)) {
+        return _allocateMappedAligned(alignment, size);
+    }
+
+    // Over-allocate, so that the aligned address can be moved far enough
+    // into the block for the part in front of it to become a free block.
+    uint8_t *data = my_malloc(size + alignment + MIN_BLOCK_SIZE);
+    if (data == NULL) {
+        return NULL;
+    }
+    Block *block = (Block*)data - 1;
+
+    uint8_t *aligned = (uint8_t*)(((uintptr_t)data + alignment - 1) & ~(alignment - 1));
+    if ((aligned != data) && ((uint64_t)(aligned - data) < MIN_BLOCK_SIZE)) {
+        aligned += alignment;
+    }
+
+    _lockHeap();
+
+    if (aligned != data) {
+        const uint64_t leadSize = (uint64_t)(aligned - data);
+
+        Block *alignedBlock = (Block*)aligned - 1;
+        alignedBlock->next = ALLOCATED_BLOCK_MAGIC;
+        alignedBlock->size = _blockSize(block) - leadSize;
+
+        block->size = leadSize | (block->size & BLOCK_PREV_FREE);
+        _freeBlock(block);
+        block = alignedBlock;
+    }
+    _splitTail(block, _requestedBlockSize(size));
+
+    pthread_mutex_unlock(&malloc_lock);
+
+    return aligned;
+}
+
+/*
+ * Fill in a snapshot of the allocator statistics. This only holds
+ * malloc_lock for a few reads, so it can be polled under load. Calls
+ * counted by running threads show up with a delay of up to
+ * STATS_FLUSH_INTERVAL per thread.
+ */
+void getAllocatorStats(AllocatorStats *stats)
+{
+    _lockHeap();
+
+    stats->heapBytes      = _heapBytes;
+    stats->bytesInUse     = _heapBytes - _freeBytes - _regionCount * HEADER_SIZE;
+    stats->freeBytes      = _freeBytes;
+    stats->freeBlockCount = _freeBlockCount;
+    memcpy(stats->freeBlockHistogram, _freeBlockHistogram, sizeof(_freeBlockHistogram));
+
+    // The largest free block is the rightmost tree node, or in the
+    // highest non-empty small bin if the tree is empty.
+    stats->largestFreeBlock = 0;
+    if (_sizeTree != NULL) {
+        const Block *node = _sizeTree;
+        while (TREE_LINKS(node)->right != NULL) {
+            node = TREE_LINKS(node)->right;
+        }
+        stats->largestFreeBlock = _blockSize(node);
+    } else if (_smallBinMap != 0) {
+        stats->largestFreeBlock = (uint64_t)(64 - __builtin_clzll(_smallBinMap)) * HEADER_SIZE;
+    }
+
+    pthread_mutex_unlock(&malloc_lock);
+
+    stats->fragmentation = (stats->freeBytes == 0) ? 0.0 :
+        1.0 - (double)stats->largestFreeBlock / (double)stats->freeBytes;
+
+    stats->mappedBytes     = __atomic_load_n(&_mappedBytes, __ATOMIC_RELAXED);
+    stats->allocCount      = __atomic_load_n(&_allocCount, __ATOMIC_RELAXED);
+    stats->freeCount       = __atomic_load_n(&_freeCount, __ATOMIC_RELAXED);
+    stats->lockContentions = __atomic_load_n(&_lockContentions, __ATOMIC_RELAXED);
+    stats->lockWaitNanos   = __atomic_load_n(&_lockWaitNanos, __ATOMIC_RELAXED);
+}
+
+/*
+ * Pools hand out objects of one fixed size. Objects are carved out of
+ * slabs allocated with my_malloc and have no header of their own; free
+ * objects are linked through their first word. Threads take objects from
+ * and return them to their magazine, and only lock the pool to move a
+ * batch between the magazine and the pool. Pools do not survive
+ * initAllocator().
+ */
+#define POOL_SLAB_SIZE (64 * 1024)
+
+struct _Pool {
+    pthread_mutex_t lock;
+    /*
+     * Size of every object, rounded up to 16 bytes.
+     */
+    uint64_t objectSize;
+    /*
+     * Objects that were freed with pool_free.
+     */
+    void *freeList;
+    /*
+     * The part of the newest slab that was never handed out.
+     */
+    uint8_t *unused;
+    uint8_t *unusedEnd;
+    /*
+     * All slabs of the pool, linked through their first word.
+     */
+    void *slabs;
+    /*
+     * Unique among all pools ever created, and the link in the list of
+     * live pools.
+     */
+    uint64_t serial;
+    Pool *next;
+};
+
+/*
+ * The live pools, so an exiting thread only returns its objects to pools
+ * that were not destroyed yet.
+ */
+static pthread_mutex_t _poolsLock = PTHREAD_MUTEX_INITIALIZER;
+static Pool *_pools;
+static uint64_t _poolSerial;
+
+static void _resetPools(void)
+{
+    pthread_mutex_lock(&_poolsLock);
+    _pools = NULL;
+    pthread_mutex_unlock(&_poolsLock);
+}
+
+/*
+ * Whether the pool of a magazine is still alive. _poolsLock must be held.
+ */
+static int _isPoolAlive(const PoolMagazine *magazine)
+{
+    for (Pool *pool = _pools; pool != NULL; pool = pool->next) {
+        if (pool == magazine->pool) {
+            return pool->serial == magazine->serial;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Return up to count objects of a magazine to its pool.
+ */
+static void _drainMagazine(PoolMagazine *magazine, uint32_t count)
+{
+    if ((count == 0) || (magazine->objects == NULL)) {
+        return;
+    }
+
+    // Unlink the batch first, then splice it into the free list.
+    void *first = magazine->objects;
+    void *last = first;
+    uint32_t taken = 1;
+    while ((taken < count) && (*(void**)last != NULL)) {
+        last = *(void**)last;
+        taken++;
+    }
+    magazine->objects = *(void**)last;
+    magazine->count -= taken;
+
+    Pool *pool = magazine->pool;
+    pthread_mutex_lock(&pool->lock);
+    *(void**)last = pool->freeList;
+    pool->freeList = first;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Give a magazine back to its pool if the pool is still alive, and mark
+ * it unused.
+ */
+static void _releaseMagazine(PoolMagazine *magazine)
+{
+    if (magazine->pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&_poolsLock);
+    if (_isPoolAlive(magazine)) {
+        _drainMagazine(magazine, magazine->count);
+    }
+    pthread_mutex_unlock(&_poolsLock);
+    memset(magazine, 0, sizeof(*magazine));
+}
+
+static void _flushMagazines(ThreadCache *cache)
+{
+    if (cache->generation != _heapGeneration) {
+        return;
+    }
+    for (int i = 0; i < POOL_MAGAZINE_COUNT; i++) {
+        _releaseMagazine(&cache->magazines[i]);
+    }
+}
+
+/*
+ * Get the calling thread's magazine for a pool, taking over an unused or
+ * stale one, or else giving back the least recently taken over one.
+ */
+static PoolMagazine *_getMagazine(Pool *pool)
+{
+    ThreadCache *cache = _getThreadCache();
+    PoolMagazine *victim = &cache->magazines[POOL_MAGAZINE_COUNT - 1];
+
+    for (int i = 0; i < POOL_MAGAZINE_COUNT; i++) {
+        PoolMagazine *magazine = &cache->magazines[i];
+        if (magazine->pool == pool) {
+            if (magazine->serial == pool->serial) {
+                return magazine;
+            }
+            // The pool was destroyed and its memory reused for this one.
+            memset(magazine, 0, sizeof(*magazine));
+        }
+        if ((magazine->pool == NULL) && (victim->pool != NULL)) {
+            victim = magazine;
+        }
+    }
+
+    if (victim->pool != NULL) {
+        _releaseMagazine(victim);
+    }
+    // Keep the magazines in the order they were taken over.
+    memmove(&cache->magazines[1], &cache->magazines[0],
+            (uint64_t)(victim - &cache->magazines[0]) * sizeof(PoolMagazine));
+    victim = &cache->magazines[0];
+    victim->pool    = pool;
+    victim->serial  = pool->serial;
+    victim->objects = NULL;
+    victim->count   = 0;
+    return victim;
+}
+
+/*
+ * Move up to POOL_MAGAZINE_BATCH objects from an empty magazine's pool to
+ * the magazine. Returns 0 if the pool is out of memory.
+ */
+static int _refillMagazine(PoolMagazine *magazine)
+{
+    Pool *pool = magazine->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (magazine->count < POOL_MAGAZINE_BATCH) {
+        void *object;
+
+        if (pool->freeList != NULL) {
+            object = pool->freeList;
+            pool->freeList = *(void**)object;
+        } else {
+            if (pool->unused + pool->objectSize > pool->unusedEnd) {
+                if (magazine->count > 0) {
+                    break;
+                }
+                // Start a new slab. The first 16 bytes link the slabs.
+                uint8_t *slab = my_malloc(POOL_SLAB_SIZE);
+                if (slab == NULL) {
+                    break;
+                }
+                *(void**)slab = pool->slabs;
+                pool->slabs = slab;
+                pool->unused    = slab + HEADER_SIZE;
+                pool->unusedEnd = slab + POOL_SLAB_SIZE;
+            }
+            object = pool->unused;
+            pool->unused += pool->objectSize;
+        }
+
+        *(void**)object = magazine->objects;
+        magazine->objects = object;
+        magazine->count++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return magazine->count > 0;
+}
+
+Pool *pool_create(uint64_t objectSize)
+{
+    if ((objectSize == 0) || (roundUp(objectSize) > POOL_SLAB_SIZE - HEADER_SIZE)) {
+        return NULL;
+    }
+
+    Pool *pool = my_malloc(sizeof(Pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->objectSize = roundUp(objectSize);
+    pool->freeList   = NULL;
+    pool->unused     = NULL;
+    pool->unusedEnd  = NULL;
+    pool->slabs      = NULL;
+
+    pthread_mutex_lock(&_poolsLock);
+    pool->serial = ++_poolSerial;
+    pool->next   = _pools;
+    _pools = pool;
+    pthread_mutex_unlock(&_poolsLock);
+    return pool;
+}
+
+void *pool_alloc(Pool *pool)
+{
+    PoolMagazine *magazine = _getMagazine(pool);
+
+    if ((magazine->objects == NULL) && !_refillMagazine(magazine)) {
+        return NULL;
+    }
+
+    void *object = magazine->objects;
+    magazine->objects = *(void**)object;
+    magazine->count--;
+    return object;
+}
+
+void pool_free(Pool *pool, void *object)
+{
+    if (object == NULL) {
+        return;
+    }
+
+    PoolMagazine *magazine = _getMagazine(pool);
+    *(void**)object = magazine->objects;
+    magazine->objects = object;
+    if (++magazine->count > POOL_MAGAZINE_LIMIT) {
+        _drainMagazine(magazine, POOL_MAGAZINE_BATCH);
+    }
+}
+
+/*
+ * Free the pool and all of its slabs, including objects still in use.
+ * Objects in the magazines of other threads are dropped by them later.
+ */
+void pool_destroy(Pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&_poolsLock);
+    for (Pool **link = &_pools; *link != NULL; link = &(*link)->next) {
+        if (*link == pool) {
+            *link = pool->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_poolsLock);
+
+    // The calling thread's magazine goes with the slabs.
+    ThreadCache *cache = _getThreadCache();
+    for (int i = 0; i < POOL_MAGAZINE_COUNT; i++) {
+        if (cache->magazines[i].pool == pool) {
+            memset(&cache->magazines[i], 0, sizeof(PoolMagazine));
+        }
+    }
+
+    void *slab = pool->slabs;
+    while (slab) {
+        void *next = *(void**)slab;
+        my_free(slab);
+        slab = next;
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    my_free(pool);
 }
@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+#include "malloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+ * Benchmark for my_malloc/my_free with glibc malloc as the baseline.
+ *
+ * Every combination of workload, allocator and thread count runs in a child
+ * process of its own, so the peak RSS reported by wait4() belongs to that
+ * run alone. The child sends its results back through a pipe.
+ */
+
+#define MAX_THREADS     64
+#define SLOTS           1024
+#define LATENCY_SAMPLES 65536
+// Time one in SAMPLE_INTERVAL operations, reading the clock is not free.
+#define SAMPLE_INTERVAL 16
+#define QUEUE_SIZE      1024
+
+typedef struct _Allocator {
+    const char *name;
+    void *(*alloc)(uint64_t size);
+    void (*release)(void *address);
+} Allocator;
+
+typedef struct _Workload {
+    const char *name;
+    void *(*run)(void *arg);
+    /*
+     * Workloads whose threads work in pairs need an even thread count.
+     */
+    int pairs;
+} Workload;
+
+/*
+ * What a child process reports to the parent.
+ */
+typedef struct _Result {
+    uint64_t ops;
+    double seconds;
+    uint64_t p50Nanos;
+    uint64_t p99Nanos;
+} Result;
+
+typedef struct _Worker {
+    pthread_t thread;
+    int index;
+    unsigned seed;
+    uint64_t ops;
+    uint64_t sampleCount;
+    uint64_t *samples;
+} Worker;
+
+/*
+ * A bounded queue from a producer to a consumer thread.
+ */
+typedef struct _Channel {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    void *items[QUEUE_SIZE];
+    unsigned head;
+    unsigned count;
+    int done;
+} Channel;
+
+static const Allocator *_allocator;
+static uint64_t _opsPerThread = 1000000;
+static int _threadCount;
+static Worker _workers[MAX_THREADS];
+static Channel _channels[MAX_THREADS / 2];
+static void **_larsonSlots[MAX_THREADS];
+static pthread_barrier_t _larsonBarrier;
+
+static void *_glibcAlloc(uint64_t size)
+{
+    return malloc(size);
+}
+
+static void _glibcRelease(void *address)
+{
+    free(address);
+}
+
+static const Allocator _allocators[] = {
+    { "my_malloc", my_malloc,   my_free },
+    { "glibc",     _glibcAlloc, _glibcRelease },
+};
+
+static uint64_t _nanos(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * Random size: mostly small, sometimes medium, rarely large.
+ */
+static uint64_t _randomSize(unsigned *seed)
+{
+    const int kind = rand_r(seed) % 100;
+    if (kind < 80) {
+        return 8 + rand_r(seed) % 248;
+    }
+    if (kind < 98) {
+        return 256 + rand_r(seed) % 8192;
+    }
+    return 65536 + rand_r(seed) % 262144;
+}
+
+/*
+ * Allocate and touch a block, timing every SAMPLE_INTERVAL-th call.
+ */
+static void *_alloc(Worker *worker, uint64_t size)
+{
+    void *address;
+
+    if ((worker->ops % SAMPLE_INTERVAL == 0) && (worker->sampleCount < LATENCY_SAMPLES)) {
+        const uint64_t start = _nanos();
+        address = _allocator->alloc(size);
+        worker->samples[worker->sampleCount++] = _nanos() - start;
+    } else {
+        address = _allocator->alloc(size);
+    }
+    worker->ops++;
+
+    if (address != NULL) {
+        *(volatile uint8_t*)address = 1;
+    }
+    return address;
+}
+
+static void _release(Worker *worker, void *address)
+{
+    if ((worker->ops % SAMPLE_INTERVAL == 0) && (worker->sampleCount < LATENCY_SAMPLES)) {
+        const uint64_t start = _nanos();
+        _allocator->release(address);
+        worker->samples[worker->sampleCount++] = _nanos() - start;
+    } else {
+        _allocator->release(address);
+    }
+    worker->ops++;
+}
+
+/*
+ * Random sizes, each thread allocating and freeing in its own slots.
+ */
+static void *_runRandom(void *arg)
+{
+    Worker *worker = arg;
+    void *slots[SLOTS] = { NULL };
+
+    while (worker->ops < _opsPerThread) {
+        const int i = rand_r(&worker->seed) % SLOTS;
+        if (slots[i] != NULL) {
+            _release(worker, slots[i]);
+            slots[i] = NULL;
+        } else {
+            slots[i] = _alloc(worker, _randomSize(&worker->seed));
+        }
+    }
+    for (int i = 0; i < SLOTS; i++) {
+        if (slots[i] != NULL) {
+            _release(worker, slots[i]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Even threads allocate and pass the blocks to the next odd thread, which
+ * frees them.
+ */
+static void *_runProducerConsumer(void *arg)
+{
+    Worker *worker = arg;
+    Channel *channel = &_channels[worker->index / 2];
+
+    if (worker->index % 2 == 0) {
+        while (worker->ops < _opsPerThread) {
+            void *address = _alloc(worker, _randomSize(&worker->seed) % 1024);
+
+            pthread_mutex_lock(&channel->lock);
+            while (channel->count == QUEUE_SIZE) {
+                pthread_cond_wait(&channel->notFull, &channel->lock);
+            }
+            channel->items[(channel->head + channel->count) % QUEUE_SIZE] = address;
+            channel->count++;
+            pthread_cond_signal(&channel->notEmpty);
+            pthread_mutex_unlock(&channel->lock);
+        }
+
+        pthread_mutex_lock(&channel->lock);
+        channel->done = 1;
+        pthread_cond_signal(&channel->notEmpty);
+        pthread_mutex_unlock(&channel->lock);
+    } else {
+        for (;;) {
+            pthread_mutex_lock(&channel->lock);
+            while ((channel->count == 0) && !channel->done) {
+                pthread_cond_wait(&channel->notEmpty, &channel->lock);
+            }
+            if (channel->count == 0) {
+                pthread_mutex_unlock(&channel->lock);
+                break;
+            }
+            void *address = channel->items[channel->head];
+            channel->head = (channel->head + 1) % QUEUE_SIZE;
+            channel->count--;
+            pthread_cond_signal(&channel->notFull);
+            pthread_mutex_unlock(&channel->lock);
+
+            _release(worker, address);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Larson-style: threads replace random blocks in their slots, and after
+ * every round the slot arrays move on to the next thread, so most blocks
+ * are freed by a different thread than the one that allocated them.
+ */
+static void *_runLarson(void *arg)
+{
+    Worker *worker = arg;
+    const int rounds = 16;
+
+    for (int round = 0; round < rounds; round++) {
+        void **slots = _larsonSlots[(worker->index + round) % _threadCount];
+
+        while (worker->ops < _opsPerThread * (uint64_t)(round + 1) / rounds) {
+            const int i = rand_r(&worker->seed) % SLOTS;
+            if (slots[i] != NULL) {
+                _release(worker, slots[i]);
+            }
+            slots[i] = _alloc(worker, 16 + rand_r(&worker->seed) % 512);
+        }
+        pthread_barrier_wait(&_larsonBarrier);
+    }
+    return NULL;
+}
+
+/*
+ * Fragmentation soak: a long-lived working set of mixed sizes where every
+ * replacement has a different size than the block it replaces.
+ */
+static void *_runSoak(void *arg)
+{
+    Worker *worker = arg;
+    const int slotCount = SLOTS * 8;
+    void **slots = calloc(slotCount, sizeof(void*));
+
+    for (int i = 0; i < slotCount; i++) {
+        slots[i] = _alloc(worker, _randomSize(&worker->seed) % 16384);
+    }
+    while (worker->ops < _opsPerThread) {
+        const int i = rand_r(&worker->seed) % slotCount;
+        _release(worker, slots[i]);
+        slots[i] = _alloc(worker, _randomSize(&worker->seed) % 16384);
+    }
+    for (int i = 0; i < slotCount; i++) {
+        _release(worker, slots[i]);
+    }
+
+    free(slots);
+    return NULL;
+}
+
+static const Workload _workloads[] = {
+    { "random",   _runRandom,           0 },
+    { "prodcons", _runProducerConsumer, 1 },
+    { "larson",   _runLarson,           0 },
+    { "soak",     _runSoak,             0 },
+};
+
+static int _compareSamples(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t*)a;
+    const uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Run one workload in the calling (child) process.
+ */
+static Result _runWorkload(const Workload *workload)
+{
+    Result result = { 0 };
+
+    if (_allocator->alloc == my_malloc) {
+        initAllocator();
+    }
+
+    for (int i = 0; i < _threadCount / 2; i++) {
+        pthread_mutex_init(&_channels[i].lock, NULL);
+        pthread_cond_init(&_channels[i].notEmpty, NULL);
+        pthread_cond_init(&_channels[i].notFull, NULL);
+    }
+    for (int i = 0; i < _threadCount; i++) {
+        _larsonSlots[i] = calloc(SLOTS, sizeof(void*));
+    }
+    pthread_barrier_init(&_larsonBarrier, NULL, _threadCount);
+
+    const uint64_t start = _nanos();
+    for (int i = 0; i < _threadCount; i++) {
+        _workers[i].index   = i;
+        _workers[i].seed    = (unsigned)i * 7919 + 1;
+        _workers[i].samples = malloc(LATENCY_SAMPLES * sizeof(uint64_t));
+        pthread_create(&_workers[i].thread, NULL, workload->run, &_workers[i]);
+    }
+    for (int i = 0; i < _threadCount; i++) {
+        pthread_join(_workers[i].thread, NULL);
+    }
+    result.seconds = (double)(_nanos() - start) / 1e9;
+
+    // Collect all samples and the operation counts.
+    uint64_t sampleCount = 0;
+    for (int i = 0; i < _threadCount; i++) {
+        sampleCount += _workers[i].sampleCount;
+    }
+    uint64_t *samples = malloc((sampleCount + 1) * sizeof(uint64_t));
+    sampleCount = 0;
+    for (int i = 0; i < _threadCount; i++) {
+        memcpy(&samples[sampleCount], _workers[i].samples, _workers[i].sampleCount * sizeof(uint64_t));
+        sampleCount += _workers[i].sampleCount;
+        result.ops  += _workers[i].ops;
+    }
+    qsort(samples, sampleCount, sizeof(uint64_t), _compareSamples);
+    if (sampleCount > 0) {
+        result.p50Nanos = samples[sampleCount / 2];
+        result.p99Nanos = samples[sampleCount * 99 / 100];
+    }
+    return result;
+}
+
+/*
+ * Run one workload in a child process and print its results.
+ * Return -1 if the child failed.
+ */
+static int _runChild(const Workload *workload)
+{
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        return -1;
+    }
+
+    pid_t child = fork();
+    if (child == -1) {
+        return -1;
+    } else if (child == 0) {
+        close(pipefd[0]);
+        Result result = _runWorkload(workload);
+        if (write(pipefd[1], &result, sizeof(result)) != (ssize_t)sizeof(result)) {
+            _exit(1);
+        }
+        close(pipefd[1]);
+        _exit(0);
+    }
+
+    close(pipefd[1]);
+    Result result;
+    ssize_t received = read(pipefd[0], &result, sizeof(result));
+    close(pipefd[0]);
+
+    int status;
+    struct rusage usage;
+    if ((wait4(child, &status, 0, &usage) == -1) || !WIFEXITED(status) ||
+        (WEXITSTATUS(status) != 0) || (received != sizeof(result))) {
+        printf("%-9s %-10s %7d   failed\n", workload->name, _allocator->name, _threadCount);
+        return -1;
+    }
+
+    printf("%-9s %-10s %7d %14.0f %9" PRIu64 " %9" PRIu64 " %12ld\n",
+        workload->name, _allocator->name, _threadCount,
+        (double)result.ops / result.seconds, result.p50Nanos, result.p99Nanos,
+        usage.ru_maxrss);
+    fflush(stdout);
+    return 0;
+}
+
+static void _usage(const char *program)
+{
+    fprintf(stderr,
+        "Usage: %s [-t max_threads] [-n ops_per_thread] [-w workload] [-a allocator]\n"
+        "  workloads:  random, prodcons, larson, soak (default: all)\n"
+        "  allocators: my_malloc, glibc (default: both)\n"
+        "Thread counts are powers of two up to max_threads (default 32).\n",
+        program);
+}
+
+int main(int argc, char *argv[])
+{
+    int maxThreads = 32;
+    const char *workloadName  = NULL;
+    const char *allocatorName = NULL;
+    int opt, hadError = 0;
+
+    while ((opt = getopt(argc, argv, "t:n:w:a:h")) != -1) {
+        switch (opt) {
+            case 't':
+                maxThreads = atoi(optarg);
+                break;
+            case 'n':
+                _opsPerThread = strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                workloadName = optarg;
+                break;
+            case 'a':
+                allocatorName = optarg;
+                break;
+            default:
+                _usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if ((maxThreads < 1) || (maxThreads > MAX_THREADS) || (_opsPerThread == 0)) {
+        _usage(argv[0]);
+        return 1;
+    }
+
+    printf("%-9s %-10s %7s %14s %9s %9s %12s\n",
+        "workload", "allocator", "threads", "ops/s", "p50(ns)", "p99(ns)", "maxrss(KiB)");
+
+    for (size_t w = 0; w < sizeof(_workloads) / sizeof(_workloads[0]); w++) {
+        const Workload *workload = &_workloads[w];
+        if ((workloadName != NULL) && (strcmp(workloadName, workload->name) != 0)) {
+            continue;
+        }
+
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            _threadCount = (workload->pairs && (threads < 2)) ? 2 : threads;
+
+            for (size_t a = 0; a < sizeof(_allocators) / sizeof(_allocators[0]); a++) {
+                _allocator = &_allocators[a];
+                if ((allocatorName != NULL) && (strcmp(allocatorName, _allocator->name) != 0)) {
+                    continue;
+                }
+                if (_runChild(workload) != 0) {
+                    hadError = 1;
+                }
+            }
+            if (_threadCount > threads) {
+                threads = _threadCount;
+            }
+        }
+    }
+    return hadError ? 1 : 0;
+}
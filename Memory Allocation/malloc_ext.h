@@ -0,0 +1,68 @@
+#pragma once
+#include "malloc.h"
+
+/*
+ * The allocator functions beyond plain my_malloc/my_free.
+ */
+
+/*
+ * Free blocks are counted by size in power-of-two buckets: bucket i holds
+ * blocks of [32 << i, 64 << i) bytes, the last one everything above.
+ */
+#define STATS_HISTOGRAM_BUCKETS 16
+
+/*
+ * A snapshot of the allocator, see getAllocatorStats().
+ */
+typedef struct _AllocatorStats {
+    /*
+     * Bytes of all heap regions, and the part of it in allocated blocks
+     * (including headers and blocks in thread caches).
+     */
+    uint64_t heapBytes;
+    uint64_t bytesInUse;
+    /*
+     * Bytes in blocks with a mapping of their own.
+     */
+    uint64_t mappedBytes;
+    uint64_t freeBytes;
+    uint64_t largestFreeBlock;
+    uint64_t freeBlockCount;
+    uint64_t freeBlockHistogram[STATS_HISTOGRAM_BUCKETS];
+    /*
+     * 1 - largestFreeBlock / freeBytes: 0 if all free memory is in one
+     * block, close to 1 if it is scattered over many small ones.
+     */
+    double fragmentation;
+    uint64_t allocCount;
+    uint64_t freeCount;
+    /*
+     * Number of times malloc_lock was contended and the total time spent
+     * waiting for it.
+     */
+    uint64_t lockContentions;
+    uint64_t lockWaitNanos;
+} AllocatorStats;
+
+/*
+ * A pool of objects of one fixed size, see pool_create().
+ */
+typedef struct _Pool Pool;
+
+void *my_realloc(void *address, uint64_t size);
+/*
+ * Alignment must be a power of two. The result is freed with my_free.
+ */
+void *my_aligned_alloc(uint64_t alignment, uint64_t size);
+void getAllocatorStats(AllocatorStats *stats);
+
+/*
+ * Returns NULL if objectSize is 0 or does not fit into a slab.
+ */
+Pool *pool_create(uint64_t objectSize);
+void *pool_alloc(Pool *pool);
+void pool_free(Pool *pool, void *object);
+/*
+ * Frees all objects of the pool, including the ones still in use.
+ */
+void pool_destroy(Pool *pool);
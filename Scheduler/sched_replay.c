@@ -0,0 +1,620 @@
+#include "scheduler_ext.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+/*
+ * Replays a workload against the scheduler and reports how well each
+ * policy served it.
+ *
+ * The workload comes from a trace file (-f) or from a synthetic generator.
+ * Time is counted in ticks. For every policy the program reports:
+ *  - scheduling decisions per second of wall-clock time (the whole replay
+ *    loop is timed, so this includes the bookkeeping of the harness),
+ *  - wait time: ticks a thread spent ready but not running, the mean in
+ *    the summary and every thread's own in a table after it,
+ *  - mean turnaround time: ticks from the start of a thread to its end,
+ *  - Jain's fairness index over the share of its ready time each thread
+ *    actually ran, cpu / (cpu + wait),
+ *  - p99 latency from getting ready to running.
+ *
+ * Trace file format, one event per line, ordered by time ('#' starts a
+ * comment). Threads are any non-negative int. Preempt and wait name a CPU
+ * rather than a thread, so the same trace can be replayed under any policy:
+ *   <time> start <thread>     a new thread gets ready
+ *   <time> ready <thread>     a waiting thread gets ready
+ *   <time> schedule <cpu>     the CPU picks its next thread; a thread still
+ *                             running there is preempted first
+ *   <time> preempt <cpu>      the thread running on the CPU is preempted
+ *   <time> wait <cpu>         the thread running on the CPU starts waiting
+ * A ready event for a thread that is not waiting under the policy being
+ * replayed is skipped and counted.
+ */
+
+#define MAX_LINE     256
+
+typedef enum _SimState {
+    SIM_READY = 0,
+    SIM_RUNNING,
+    SIM_WAITING
+} SimState;
+
+/*
+ * A thread as the harness sees it, independent of the scheduler's own
+ * bookkeeping. A thread gets one when it starts.
+ */
+typedef struct _SimThread {
+    int threadId;
+    SimState state;
+    uint64_t startTime;
+    uint64_t endTime;
+    uint64_t readyTime;
+    uint64_t cpuTime;
+    uint64_t waitTime;
+    /*
+     * Synthetic generator only: CPU time left in the current burst and in
+     * total, and the mean burst and I/O wait lengths.
+     */
+    uint64_t burstLeft;
+    uint64_t workLeft;
+    unsigned meanBurst;
+    unsigned meanWait;
+} SimThread;
+
+typedef struct _Metrics {
+    uint64_t decisions;
+    uint64_t skipped;
+    uint64_t *latencies;
+    uint64_t latencyCount;
+    uint64_t latencyCapacity;
+    double seconds;
+} Metrics;
+
+/*
+ * The threads in the order they started, and an open addressing hash map
+ * from thread IDs to their index, -1 for empty entries.
+ */
+static SimThread *_simThreads;
+static int _simUsed;
+static int _simCapacity;
+static int *_simMap;
+static uint32_t _simMapMask;
+
+/*
+ * The thread IDs running on each CPU, -1 if idle.
+ */
+static int _running[MAX_CPUS];
+static uint64_t _runSince[MAX_CPUS];
+static Metrics _metrics;
+
+// Synthetic workload parameters
+static int _simThreadCount = 64;
+static int _simCpuCount    = 1;
+static unsigned _quantum   = 10;
+static unsigned _work      = 2000;
+static int _interactivePercent = 50;
+static unsigned _seed      = 1;
+
+static const struct {
+    const char *name;
+    SchedulingPolicy policy;
+} _policies[] = {
+    { "fifo", POLICY_FIFO },
+    { "mlfq", POLICY_MLFQ },
+    { "fair", POLICY_FAIR },
+};
+#define POLICY_COUNT (sizeof(_policies) / sizeof(_policies[0]))
+
+/*
+ * The wait time of every thread under each policy that ran, for the
+ * per-thread table.
+ */
+static uint64_t *_policyWaits[POLICY_COUNT];
+
+static uint64_t _nanos(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * Exponentially distributed random number with the given mean, at least 1.
+ */
+static uint64_t _randomLength(unsigned *seed, unsigned mean)
+{
+    const double uniform = (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0);
+    const uint64_t length = (uint64_t)(-log(uniform) * mean);
+    return (length > 0) ? length : 1;
+}
+
+static uint32_t _hashThreadId(int threadId)
+{
+    uint32_t hash = (uint32_t)threadId * 0x9e3779b1u;
+    return hash ^ (hash >> 16);
+}
+
+static void _insertSimMap(int index)
+{
+    uint32_t entry = _hashThreadId(_simThreads[index].threadId) & _simMapMask;
+    while (_simMap[entry] >= 0) {
+        entry = (entry + 1) & _simMapMask;
+    }
+    _simMap[entry] = index;
+}
+
+/*
+ * Return the thread with the given ID, NULL if it did not start.
+ */
+static SimThread *_findSimThread(int threadId)
+{
+    if (_simUsed == 0) {
+        return NULL;
+    }
+
+    for (uint32_t entry = _hashThreadId(threadId) & _simMapMask; _simMap[entry] >= 0;
+         entry = (entry + 1) & _simMapMask) {
+        if (_simThreads[_simMap[entry]].threadId == threadId) {
+            return &_simThreads[_simMap[entry]];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Add a zeroed thread with the given ID. Earlier pointers to threads are
+ * invalid afterwards.
+ */
+static SimThread *_addSimThread(int threadId)
+{
+    if (_simUsed == _simCapacity) {
+        // Keep the map at most half full.
+        _simCapacity = (_simCapacity > 0) ? 2 * _simCapacity : 256;
+        _simMapMask  = 2 * (uint32_t)_simCapacity - 1;
+        _simThreads  = realloc(_simThreads, _simCapacity * sizeof(SimThread));
+        free(_simMap);
+        _simMap = malloc((_simMapMask + 1) * sizeof(int));
+        if ((_simThreads == NULL) || (_simMap == NULL)) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(_simMap, 0xff, (_simMapMask + 1) * sizeof(int));
+        for (int index = 0; index < _simUsed; index++) {
+            _insertSimMap(index);
+        }
+    }
+
+    SimThread *thread = &_simThreads[_simUsed];
+    memset(thread, 0, sizeof(*thread));
+    thread->threadId = threadId;
+    _insertSimMap(_simUsed++);
+    return thread;
+}
+
+static void _resetMetrics(void)
+{
+    free(_metrics.latencies);
+    memset(&_metrics, 0, sizeof(_metrics));
+    if (_simMap != NULL) {
+        memset(_simMap, 0xff, (_simMapMask + 1) * sizeof(int));
+    }
+    _simUsed = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        _running[cpu] = -1;
+    }
+}
+
+static void _markReady(SimThread *thread, uint64_t now)
+{
+    thread->state     = SIM_READY;
+    thread->readyTime = now;
+}
+
+/*
+ * Let the CPU pick its next thread and record how long that thread waited.
+ */
+static void _schedule(int cpu, uint64_t now)
+{
+    const int threadId = scheduleNextThreadOnCpu(cpu);
+    _metrics.decisions++;
+    if (threadId < 0) {
+        return;
+    }
+
+    SimThread *thread = _findSimThread(threadId);
+    const uint64_t latency = now - thread->readyTime;
+    thread->waitTime += latency;
+    thread->state    = SIM_RUNNING;
+    _running[cpu]    = threadId;
+    _runSince[cpu]   = now;
+
+    if (_metrics.latencyCount == _metrics.latencyCapacity) {
+        _metrics.latencyCapacity = (_metrics.latencyCapacity > 0) ? 2 * _metrics.latencyCapacity : 4096;
+        _metrics.latencies = realloc(_metrics.latencies, _metrics.latencyCapacity * sizeof(uint64_t));
+        if (_metrics.latencies == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    _metrics.latencies[_metrics.latencyCount++] = latency;
+}
+
+/*
+ * Take the running thread off the CPU. Return it, NULL if the CPU was idle.
+ */
+static SimThread *_stop(int cpu, uint64_t now)
+{
+    const int threadId = _running[cpu];
+    if (threadId < 0) {
+        return NULL;
+    }
+
+    SimThread *thread = _findSimThread(threadId);
+    thread->cpuTime += now - _runSince[cpu];
+    thread->endTime  = now;
+    _running[cpu]    = -1;
+    return thread;
+}
+
+/*
+ * Parse a number from 0 to max. Return -1 if it is not one.
+ */
+static int _parseNumber(const char *text, long max)
+{
+    char *end;
+    errno = 0;
+    const long value = strtol(text, &end, 10);
+    if ((*end != '\0') || (errno != 0) || (value < 0) || (value > max)) {
+        return -1;
+    }
+    return (int)value;
+}
+
+/*
+ * Replay a trace file. Return -1 on a malformed line.
+ */
+static int _replayFile(FILE *file, SchedulingPolicy policy)
+{
+    char line[MAX_LINE];
+    int lineNumber = 0;
+    uint64_t lastTime = 0;
+
+    initSchedulerWithCpus(policy, MAX_CPUS);
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        unsigned long long time;
+        char event[16], argument[32];
+        const int fields = sscanf(line, "%llu %15s %31s", &time, event, argument);
+        if (fields <= 0) {
+            continue;
+        }
+
+        const int isThread = (strcmp(event, "start") == 0) || (strcmp(event, "ready") == 0);
+        const int index = (fields == 3) ? _parseNumber(argument, isThread ? INT_MAX : MAX_CPUS - 1) : -1;
+        if ((index < 0) || (time < lastTime)) {
+            fprintf(stderr, "line %d: malformed or out-of-order event\n", lineNumber);
+            return -1;
+        }
+        lastTime = time;
+
+        if (strcmp(event, "start") == 0) {
+            if (_findSimThread(index) != NULL) {
+                _metrics.skipped++;
+                continue;
+            }
+            SimThread *thread = _addSimThread(index);
+            thread->startTime = time;
+            _markReady(thread, time);
+            onThreadReadyOnCpu(index, 0);
+        } else if (strcmp(event, "ready") == 0) {
+            SimThread *thread = _findSimThread(index);
+            if ((thread == NULL) || (thread->state != SIM_WAITING)) {
+                _metrics.skipped++;
+                continue;
+            }
+            _markReady(thread, time);
+            onThreadReady(index);
+        } else if (strcmp(event, "schedule") == 0) {
+            SimThread *thread = _stop(index, time);
+            if (thread != NULL) {
+                _markReady(thread, time);
+                onThreadPreempted(thread->threadId);
+            }
+            _schedule(index, time);
+        } else if ((strcmp(event, "preempt") == 0) || (strcmp(event, "wait") == 0)) {
+            SimThread *thread = _stop(index, time);
+            if (thread == NULL) {
+                _metrics.skipped++;
+            } else if (event[0] == 'p') {
+                _markReady(thread, time);
+                onThreadPreempted(thread->threadId);
+            } else {
+                thread->state = SIM_WAITING;
+                onThreadWaiting(thread->threadId);
+            }
+        } else {
+            fprintf(stderr, "line %d: unknown event '%s'\n", lineNumber, event);
+            return -1;
+        }
+    }
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        _stop(cpu, lastTime);
+    }
+    return 0;
+}
+
+/*
+ * Run the synthetic workload: interactive threads alternate short CPU
+ * bursts with long sleeps, CPU-bound threads run for many time slices
+ * between short sleeps. Every thread ends after _work ticks of CPU time.
+ * Sleeps go through the timer wheel. Thread IDs are 0 to _simThreadCount - 1
+ * and added in that order, so they are also the index in _simThreads.
+ */
+static void _runSynthetic(SchedulingPolicy policy)
+{
+    unsigned seed = _seed;
+    int finished = 0;
+
+    initSchedulerWithCpus(policy, _simCpuCount);
+
+    for (int threadId = 0; threadId < _simThreadCount; threadId++) {
+        SimThread *thread = _addSimThread(threadId);
+        const int interactive = (int)(rand_r(&seed) % 100) < _interactivePercent;
+        thread->state     = SIM_WAITING;
+        thread->meanBurst = interactive ? 2 : 20 * _quantum;
+        thread->meanWait  = interactive ? 20 : 5;
+        thread->workLeft  = _work;
+        thread->burstLeft = _randomLength(&seed, thread->meanBurst);
+        thread->startTime = rand_r(&seed) % 1000;
+    }
+
+    uint64_t slice[MAX_CPUS] = {0};
+    for (uint64_t now = 0; finished < _simThreadCount; now++) {
+        if (now > 0) {
+            onTimerTick();
+        }
+
+        for (int threadId = 0; threadId < _simThreadCount; threadId++) {
+            if (_simThreads[threadId].startTime == now) {
+                _markReady(&_simThreads[threadId], now);
+                onThreadReadyOnCpu(threadId, threadId % _simCpuCount);
+            }
+        }
+
+        for (int cpu = 0; cpu < _simCpuCount; cpu++) {
+            if (_running[cpu] < 0) {
+                _schedule(cpu, now);
+                slice[cpu] = _quantum;
+            }
+        }
+
+        // Run every CPU for one tick.
+        for (int cpu = 0; cpu < _simCpuCount; cpu++) {
+            const int threadId = _running[cpu];
+            if (threadId < 0) {
+                continue;
+            }
+
+            SimThread *thread = &_simThreads[threadId];
+            thread->workLeft--;
+            thread->burstLeft--;
+            slice[cpu]--;
+
+            if (thread->workLeft == 0) {
+                _stop(cpu, now + 1);
+                thread->state = SIM_WAITING;
+                onThreadExit(threadId);
+                finished++;
+            } else if (thread->burstLeft == 0) {
+                const uint64_t sleep = _randomLength(&seed, thread->meanWait);
+                _stop(cpu, now + 1);
+                onThreadSleep(threadId, (unsigned)sleep);
+                _markReady(thread, now + sleep);
+                thread->burstLeft = _randomLength(&seed, thread->meanBurst);
+            } else if (slice[cpu] == 0) {
+                _stop(cpu, now + 1);
+                onThreadPreempted(threadId);
+                _markReady(thread, now + 1);
+            }
+        }
+    }
+}
+
+static int _compareLatencies(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void _report(const char *name)
+{
+    double waitSum = 0, turnaroundSum = 0, share = 0, shareSquares = 0;
+    const int count = _simUsed;
+
+    for (int index = 0; index < count; index++) {
+        const SimThread *thread = &_simThreads[index];
+
+        waitSum       += thread->waitTime;
+        turnaroundSum += thread->endTime - thread->startTime;
+        if (thread->cpuTime + thread->waitTime > 0) {
+            const double x = (double)thread->cpuTime / (thread->cpuTime + thread->waitTime);
+            share        += x;
+            shareSquares += x * x;
+        }
+    }
+
+    uint64_t p99 = 0;
+    if (_metrics.latencyCount > 0) {
+        qsort(_metrics.latencies, _metrics.latencyCount, sizeof(uint64_t), _compareLatencies);
+        p99 = _metrics.latencies[(_metrics.latencyCount - 1) * 99 / 100];
+    }
+
+    printf("%-6s %8d %12.0f %10.1f %12.1f %8.3f %9llu %8llu\n",
+        name, count,
+        (_metrics.seconds > 0) ? _metrics.decisions / _metrics.seconds : 0.0,
+        (count > 0) ? waitSum / count : 0.0,
+        (count > 0) ? turnaroundSum / count : 0.0,
+        (shareSquares > 0) ? share * share / (count * shareSquares) : 1.0,
+        (unsigned long long)p99,
+        (unsigned long long)_metrics.skipped);
+}
+
+/*
+ * Keep the wait time of every thread under the policy that just ran.
+ */
+static void _saveWaits(size_t policy)
+{
+    _policyWaits[policy] = malloc((_simUsed + 1) * sizeof(uint64_t));
+    if (_policyWaits[policy] == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int index = 0; index < _simUsed; index++) {
+        _policyWaits[policy][index] = _simThreads[index].waitTime;
+    }
+}
+
+/*
+ * Print the wait time of every thread, one column per policy that ran.
+ * Threads start in the same order under every policy, so an index refers
+ * to the same thread in every column.
+ */
+static void _reportWaits(void)
+{
+    printf("\n%-10s", "thread");
+    for (size_t p = 0; p < POLICY_COUNT; p++) {
+        if (_policyWaits[p] != NULL) {
+            printf(" %10s", _policies[p].name);
+        }
+    }
+    printf("\n");
+
+    for (int index = 0; index < _simUsed; index++) {
+        printf("%-10d", _simThreads[index].threadId);
+        for (size_t p = 0; p < POLICY_COUNT; p++) {
+            if (_policyWaits[p] != NULL) {
+                printf(" %10llu", (unsigned long long)_policyWaits[p][index]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+static void _usage(const char *program)
+{
+    fprintf(stderr,
+        "Usage: %s [-f trace] [-p policy] [-n threads] [-c cpus] [-q quantum]\n"
+        "          [-w work] [-i interactive_percent] [-s seed]\n"
+        "  policies: fifo, mlfq, fair (default: all)\n"
+        "Without -f a synthetic workload of n threads (default 64) on c CPUs\n"
+        "(default 1) runs, each thread needing 'work' ticks of CPU time\n"
+        "(default 2000) with time slices of 'quantum' ticks (default 10).\n",
+        program);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *traceName  = NULL;
+    const char *policyName = NULL;
+    int opt, hadError = 0;
+
+    while ((opt = getopt(argc, argv, "f:p:n:c:q:w:i:s:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                traceName = optarg;
+                break;
+            case 'p':
+                policyName = optarg;
+                break;
+            case 'n':
+                _simThreadCount = atoi(optarg);
+                break;
+            case 'c':
+                _simCpuCount = atoi(optarg);
+                break;
+            case 'q':
+                _quantum = (unsigned)atoi(optarg);
+                break;
+            case 'w':
+                _work = (unsigned)atoi(optarg);
+                break;
+            case 'i':
+                _interactivePercent = atoi(optarg);
+                break;
+            case 's':
+                _seed = (unsigned)atoi(optarg);
+                break;
+            default:
+                _usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if ((_simThreadCount < 1) ||
+        (_simCpuCount < 1) || (_simCpuCount > MAX_CPUS) ||
+        (_quantum == 0) || (_work == 0)) {
+        _usage(argv[0]);
+        return 1;
+    }
+
+    FILE *trace = NULL;
+    if (traceName != NULL) {
+        trace = fopen(traceName, "r");
+        if (trace == NULL) {
+            perror(traceName);
+            return 1;
+        }
+    }
+
+    printf("%-6s %8s %12s %10s %12s %8s %9s %8s\n",
+        "policy", "threads", "decisions/s", "wait", "turnaround", "jain", "p99(lat)", "skipped");
+
+    for (size_t p = 0; p < POLICY_COUNT; p++) {
+        if ((policyName != NULL) && (strcmp(policyName, _policies[p].name) != 0)) {
+            continue;
+        }
+
+        _resetMetrics();
+        const uint64_t start = _nanos();
+        if (trace != NULL) {
+            rewind(trace);
+            if (_replayFile(trace, _policies[p].policy) != 0) {
+                hadError = 1;
+                break;
+            }
+        } else {
+            _runSynthetic(_policies[p].policy);
+        }
+        _metrics.seconds = (_nanos() - start) / 1e9;
+        _report(_policies[p].name);
+        _saveWaits(p);
+    }
+    if (!hadError) {
+        _reportWaits();
+    }
+
+    if (trace != NULL) {
+        fclose(trace);
+    }
+    _resetMetrics();
+    for (size_t p = 0; p < POLICY_COUNT; p++) {
+        free(_policyWaits[p]);
+    }
+    free(_simThreads);
+    free(_simMap);
+    return hadError ? 1 : 0;
+}
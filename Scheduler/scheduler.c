@@ -1,35 +1,109 @@
 #include "scheduler.h"
+#include "scheduler_ext.h"
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 
-typedef struct _QueueItem {
-    /*
-     * The data of this item.
-     */
-    int data; // Thread ID
-    /*
-     * The next item in the queue.
-     * NULL if there is no next item.
-     */
-    struct _QueueItem *next; // Pointer to the next item in the queue
-} QueueItem;
+/*
+ * Marks the end of a queue, i.e., there is no next or previous thread.
+ */
+#define QUEUE_END -1
+
+/*
+ * Number of priority levels in the multi-level feedback queue. Level 0 is
+ * the highest priority. In FIFO mode only level 0 is used.
+ */
+#define MLFQ_LEVELS 8
+
+/*
+ * In MLFQ mode all threads go back to level 0 after this many scheduling
+ * decisions per CPU, so CPU-bound threads cannot starve.
+ */
+#define MLFQ_BOOST_INTERVAL 1000
+
+/*
+ * In fair-share mode a thread is charged FAIR_TIME_SLICE, scaled by
+ * FAIR_DEFAULT_WEIGHT / weight, each time it is preempted, and half of
+ * that when it starts to wait. A thread that gets ready is put at most one
+ * time slice before the thread with the lowest virtual runtime.
+ */
+#define FAIR_TIME_SLICE     1024
+#define FAIR_DEFAULT_WEIGHT 1024
+
+/*
+ * The timer wheel has TIMER_LEVELS levels of TIMER_SLOTS slots. A slot of
+ * level n covers TIMER_SLOTS^n ticks, so the wheel covers 2^36 ticks, more
+ * than any timeout that can be passed in.
+ */
+#define TIMER_BITS   6
+#define TIMER_SLOTS  (1 << TIMER_BITS)
+#define TIMER_MASK   (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 6
+
+/*
+ * Any non-negative int is a valid thread ID. A hash map from IDs to slots
+ * keeps the threads dense: slots are handed out from chunks of
+ * THREAD_CHUNK_SIZE threads that still have a free slot, and a chunk is
+ * freed once all of its threads exited, so the table takes memory for the
+ * live threads only, no matter how sparse their IDs are. One empty chunk is
+ * kept as a spare, so a thread starting and exiting over and over does not
+ * allocate and free a chunk every time. At most THREAD_CHUNK_COUNT chunks
+ * of threads can be live at the same time.
+ */
+#define THREAD_CHUNK_BITS  6
+#define THREAD_CHUNK_SIZE  (1 << THREAD_CHUNK_BITS)
+#define THREAD_CHUNK_MASK  (THREAD_CHUNK_SIZE - 1)
+#define THREAD_CHUNK_COUNT (1 << 16)
 
+/*
+ * Initial number of entries of the hash map, a power of two. The map
+ * doubles when more than half of its entries are used.
+ */
+#define THREAD_MAP_MIN_SIZE 256
+#define THREAD_MAP_EMPTY    UINT64_MAX
+
+/*
+ * A queue of threads. The links are stored in the thread table, so
+ * queue operations never allocate and a thread is on at most one queue.
+ */
 typedef struct _Queue {
     /*
-     * The first item of the queue.
-     * NULL if the queue is empty.
+     * The ID of the first thread in the queue.
+     * QUEUE_END if the queue is empty.
      */
-    QueueItem *head;
+    int head;
     /*
-     * The last item of the queue.
+     * The ID of the last thread in the queue.
      * undefined if the queue is empty.
      */
-    QueueItem *tail;
+    int tail;
 } Queue;
 
+/*
+ * The ready threads of one CPU, one queue per priority level. A bit in
+ * levelMap is set for every non-empty level. In fair-share mode the ready
+ * threads are in a pairing heap ordered by virtual runtime instead.
+ * Everything is protected by lock, except that readyCount may be read
+ * without it to find a CPU to steal from.
+ */
+typedef struct _RunQueue {
+    pthread_mutex_t lock;
+    Queue levels[MLFQ_LEVELS];
+    unsigned levelMap;
+    /*
+     * Root of the pairing heap (or QUEUE_END), and the virtual runtime of
+     * the last thread picked, which never decreases.
+     */
+    int fairRoot;
+    int64_t minVruntime;
+    int readyCount;
+} __attribute__ ((aligned(64))) RunQueue;
+
 typedef enum _ThreadState {
-    STATE_UNUSED = 0, // This entry in the _threads array is unused.
+    STATE_UNUSED = 0, // This entry in the thread table is unused.
     STATE_READY,      // The thread is ready and should be on a ready queue for selection by the scheduler
     STATE_RUNNING,    // The thread is running and should not be on a ready queue
     STATE_WAITING     // The thread is blocked and should not be on a ready queue
@@ -38,11 +112,429 @@ typedef enum _ThreadState {
 typedef struct _Thread {
     int threadId;
     ThreadState state;
+    /*
+     * The queue this thread is on and the run queue it belongs to, NULL if
+     * none. Changed only with the lock of that run queue held.
+     */
+    Queue *queue;
+    RunQueue *runQueue;
+    /*
+     * The CPU the thread last ran on, -1 if it never ran.
+     */
+    int cpu;
+    /*
+     * The IDs of the next and previous thread in that queue (or QUEUE_END).
+     */
+    int next;
+    int prev;
+    /*
+     * The MLFQ priority level, valid if boostEpoch is the current one.
+     */
+    int level;
+    unsigned boostEpoch;
+    /*
+     * The weighted runtime and the weight for fair-share mode.
+     */
+    int64_t vruntime;
+    unsigned weight;
+    /*
+     * Pairing heap links: first child, next sibling and previous sibling
+     * (or parent for a first child).
+     */
+    int heapChild;
+    int heapNext;
+    int heapPrev;
+    /*
+     * The tick at which a timed wait ends, the timer wheel slot the thread
+     * is on (-1 if none) and the next and previous thread in that slot.
+     * Protected by _timerLock.
+     */
+    uint64_t timerExpires;
+    int timerSlot;
+    int timerNext;
+    int timerPrev;
+    /*
+     * Set if the last timed wait ended because the timer expired.
+     */
+    int timedOut;
 } Thread;
 
+typedef struct _ThreadChunk {
+    Thread threads[THREAD_CHUNK_SIZE];
+} ThreadChunk;
+
+/*
+ * An open addressing hash map with linear probing. Every entry holds a
+ * thread ID in the upper and its slot in the lower 32 bits, so readers get
+ * both with one load, or THREAD_MAP_EMPTY.
+ */
+typedef struct _ThreadMap {
+    uint32_t mask;
+    uint32_t count;
+    /*
+     * Maps replaced by a larger one. Lookups may still be reading them, so
+     * they are only freed by initScheduler.
+     */
+    struct _ThreadMap *retired;
+    uint64_t entries[];
+} ThreadMap;
+
 // Globals
-Thread _threads[MAX_THREADS] = {{0}};
-Queue _readyQueue;
+ThreadChunk *_threadChunks[THREAD_CHUNK_COUNT];
+uint64_t _chunkUsed[THREAD_CHUNK_COUNT];
+/*
+ * Chunks with a free slot are linked through _chunkNext/_chunkPrev
+ * starting at _openChunks. Chunk indices below _chunkWatermark without a
+ * chunk are linked through _chunkNext starting at _freeChunkIndices.
+ * _spareChunk is the empty chunk that is kept, -1 if none.
+ */
+int _chunkNext[THREAD_CHUNK_COUNT];
+int _chunkPrev[THREAD_CHUNK_COUNT];
+int _openChunks = -1;
+int _freeChunkIndices = -1;
+unsigned _chunkWatermark;
+int _spareChunk = -1;
+ThreadMap *_threadMap;
+/*
+ * Odd while an entry of _threadMap is moved, see _lookupSlot.
+ */
+unsigned _threadMapSequence;
+/*
+ * Serializes all changes of the thread table.
+ */
+pthread_mutex_t _tableLock = PTHREAD_MUTEX_INITIALIZER;
+RunQueue _runQueues[MAX_CPUS];
+int _cpuCount = 1;
+SchedulingPolicy _policy;
+unsigned _boostEpoch;
+unsigned _decisions;
+int _timerWheel[TIMER_LEVELS * TIMER_SLOTS];
+uint64_t _ticks;
+pthread_mutex_t _timerLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t _hashThreadId(int threadId)
+{
+    uint32_t hash = (uint32_t)threadId * 0x9e3779b1u;
+    return hash ^ (hash >> 16);
+}
+
+/*
+ * Return the slot of a thread, -1 if it has none. This takes no lock: a
+ * found entry is always right, but if entries were moved meanwhile a
+ * thread may be missed, so a miss only counts once no move overlapped.
+ */
+static int _lookupSlot(int threadId)
+{
+    for (;;) {
+        const unsigned sequence = __atomic_load_n(&_threadMapSequence, __ATOMIC_ACQUIRE);
+        const ThreadMap *map = __atomic_load_n(&_threadMap, __ATOMIC_ACQUIRE);
+
+        if (map != NULL) {
+            uint32_t index = _hashThreadId(threadId) & map->mask;
+            for (;;) {
+                const uint64_t entry = __atomic_load_n(&map->entries[index], __ATOMIC_ACQUIRE);
+                if (entry == THREAD_MAP_EMPTY) {
+                    break;
+                }
+                if ((int)(entry >> 32) == threadId) {
+                    return (int)(uint32_t)entry;
+                }
+                index = (index + 1) & map->mask;
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (((sequence & 1) == 0) && (__atomic_load_n(&_threadMapSequence, __ATOMIC_RELAXED) == sequence)) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Return the thread in a slot. The chunk is published before the slot is
+ * put in the map, so no atomic load is needed here.
+ */
+static inline Thread *_slotThread(int slot)
+{
+    return &_threadChunks[slot >> THREAD_CHUNK_BITS]->threads[slot & THREAD_CHUNK_MASK];
+}
+
+/*
+ * Return the entry of a thread that was started.
+ */
+static inline Thread *_thread(int threadId)
+{
+    return _slotThread(_lookupSlot(threadId));
+}
+
+/*
+ * Return the entry of a thread, NULL if it has none.
+ */
+static Thread *_findThread(int threadId)
+{
+    if (threadId < 0) {
+        return NULL;
+    }
+
+    const int slot = _lookupSlot(threadId);
+    return (slot < 0) ? NULL : _slotThread(slot);
+}
+
+/*
+ * Add an entry to the map. Must be called with _tableLock held, and the
+ * map must have an empty entry left.
+ */
+static void _mapInsert(ThreadMap *map, uint64_t entry)
+{
+    uint32_t index = _hashThreadId((int)(entry >> 32)) & map->mask;
+    while (map->entries[index] != THREAD_MAP_EMPTY) {
+        index = (index + 1) & map->mask;
+    }
+    __atomic_store_n(&map->entries[index], entry, __ATOMIC_RELEASE);
+    map->count++;
+}
+
+/*
+ * Make room for one more entry, replacing the map by one twice the size
+ * if it is half full. Return -1 if out of memory.
+ * Must be called with _tableLock held.
+ */
+static int _reserveMapEntry(void)
+{
+    ThreadMap *map = _threadMap;
+    if ((map != NULL) && ((map->count + 1) * 2 <= map->mask + 1)) {
+        return 0;
+    }
+
+    const uint32_t size = (map == NULL) ? THREAD_MAP_MIN_SIZE : (map->mask + 1) * 2;
+    ThreadMap *newMap = malloc(sizeof(ThreadMap) + size * sizeof(uint64_t));
+    if (newMap == NULL) {
+        return -1;
+    }
+    newMap->mask    = size - 1;
+    newMap->count   = 0;
+    newMap->retired = map;
+    for (uint32_t index = 0; index < size; index++) {
+        newMap->entries[index] = THREAD_MAP_EMPTY;
+    }
+    if (map != NULL) {
+        for (uint32_t index = 0; index <= map->mask; index++) {
+            if (map->entries[index] != THREAD_MAP_EMPTY) {
+                _mapInsert(newMap, map->entries[index]);
+            }
+        }
+    }
+
+    __atomic_store_n(&_threadMap, newMap, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Remove the entry of a thread from the map. The entries after it are moved
+ * back instead of leaving a marker, so the map never fills up with them.
+ * Must be called with _tableLock held.
+ */
+static void _mapRemove(int threadId)
+{
+    ThreadMap *map = _threadMap;
+    uint32_t hole = _hashThreadId(threadId) & map->mask;
+    while ((int)(map->entries[hole] >> 32) != threadId) {
+        hole = (hole + 1) & map->mask;
+    }
+
+    __atomic_store_n(&_threadMapSequence, _threadMapSequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    uint32_t index = hole;
+    for (;;) {
+        index = (index + 1) & map->mask;
+        const uint64_t entry = map->entries[index];
+        if (entry == THREAD_MAP_EMPTY) {
+            break;
+        }
+
+        // The entry may fill the hole unless its probe starts after it.
+        const uint32_t home = _hashThreadId((int)(entry >> 32)) & map->mask;
+        if (((index - home) & map->mask) >= ((index - hole) & map->mask)) {
+            __atomic_store_n(&map->entries[hole], entry, __ATOMIC_RELAXED);
+            hole = index;
+        }
+    }
+    __atomic_store_n(&map->entries[hole], THREAD_MAP_EMPTY, __ATOMIC_RELAXED);
+    map->count--;
+
+    __atomic_store_n(&_threadMapSequence, _threadMapSequence + 1, __ATOMIC_RELEASE);
+}
+
+static void _pushOpenChunk(int chunk)
+{
+    _chunkPrev[chunk] = -1;
+    _chunkNext[chunk] = _openChunks;
+    if (_openChunks >= 0) {
+        _chunkPrev[_openChunks] = chunk;
+    }
+    _openChunks = chunk;
+}
+
+static void _unlinkOpenChunk(int chunk)
+{
+    if (_chunkPrev[chunk] >= 0) {
+        _chunkNext[_chunkPrev[chunk]] = _chunkNext[chunk];
+    } else {
+        _openChunks = _chunkNext[chunk];
+    }
+    if (_chunkNext[chunk] >= 0) {
+        _chunkPrev[_chunkNext[chunk]] = _chunkPrev[chunk];
+    }
+}
+
+/*
+ * Allocate a chunk for an unused index and make it the first open chunk.
+ * Return -1 if out of memory or chunk indices.
+ */
+static int _addChunk(void)
+{
+    int chunk = _freeChunkIndices;
+    if ((chunk < 0) && (_chunkWatermark < THREAD_CHUNK_COUNT)) {
+        chunk = (int)_chunkWatermark;
+    }
+    if (chunk < 0) {
+        return -1;
+    }
+
+    ThreadChunk *newChunk = calloc(1, sizeof(ThreadChunk));
+    if (newChunk == NULL) {
+        return -1;
+    }
+    if (chunk == _freeChunkIndices) {
+        _freeChunkIndices = _chunkNext[chunk];
+    } else {
+        _chunkWatermark++;
+    }
+    __atomic_store_n(&_threadChunks[chunk], newChunk, __ATOMIC_RELEASE);
+    _pushOpenChunk(chunk);
+    return chunk;
+}
+
+/*
+ * Take a free slot of the first open chunk, allocating a chunk if none is
+ * open. Return -1 if out of memory or slots. Must be called with
+ * _tableLock held.
+ */
+static int _allocateSlot(void)
+{
+    const int chunk = (_openChunks >= 0) ? _openChunks : _addChunk();
+    if (chunk < 0) {
+        return -1;
+    }
+
+    if (chunk == _spareChunk) {
+        _spareChunk = -1;
+    }
+    const int index = __builtin_ctzll(~_chunkUsed[chunk]);
+    _chunkUsed[chunk] |= 1ull << index;
+    if (_chunkUsed[chunk] == UINT64_MAX) {
+        _unlinkOpenChunk(chunk);
+    }
+    return (chunk << THREAD_CHUNK_BITS) + index;
+}
+
+/*
+ * Give a slot back. A chunk that becomes empty is kept as the spare if
+ * there is none yet, and freed otherwise. Must be called with _tableLock
+ * held.
+ */
+static void _releaseSlot(int slot)
+{
+    const int chunk = slot >> THREAD_CHUNK_BITS;
+
+    if (_chunkUsed[chunk] == UINT64_MAX) {
+        _pushOpenChunk(chunk);
+    }
+    _chunkUsed[chunk] &= ~(1ull << (slot & THREAD_CHUNK_MASK));
+    if (_chunkUsed[chunk] != 0) {
+        return;
+    }
+
+    if (_spareChunk < 0) {
+        _spareChunk = chunk;
+        return;
+    }
+    _unlinkOpenChunk(chunk);
+    free(_threadChunks[chunk]);
+    _threadChunks[chunk] = NULL;
+    _chunkNext[chunk] = _freeChunkIndices;
+    _freeChunkIndices = chunk;
+}
+
+/*
+ * Return the entry of a thread, giving it a zeroed slot if it has none.
+ * Return NULL if the ID is negative or out of memory.
+ */
+static Thread *_getThread(int threadId)
+{
+    Thread *thread = _findThread(threadId);
+    if ((thread != NULL) || (threadId < 0)) {
+        return thread;
+    }
+
+    pthread_mutex_lock(&_tableLock);
+    int slot = _lookupSlot(threadId);
+    if (slot < 0) {
+        if (_reserveMapEntry() != 0) {
+            pthread_mutex_unlock(&_tableLock);
+            return NULL;
+        }
+        slot = _allocateSlot();
+        if (slot < 0) {
+            pthread_mutex_unlock(&_tableLock);
+            return NULL;
+        }
+        memset(_slotThread(slot), 0, sizeof(Thread));
+        _mapInsert(_threadMap, ((uint64_t)threadId << 32) | (uint32_t)slot);
+    }
+    pthread_mutex_unlock(&_tableLock);
+
+    return _slotThread(slot);
+}
+
+/*
+ * Give the slot of a thread back. It must not be on any queue.
+ */
+static void _releaseThread(int threadId)
+{
+    pthread_mutex_lock(&_tableLock);
+    const int slot = _lookupSlot(threadId);
+    if (slot >= 0) {
+        _mapRemove(threadId);
+        _releaseSlot(slot);
+    }
+    pthread_mutex_unlock(&_tableLock);
+}
+
+/*
+ * Free all chunks and maps of the thread table.
+ */
+static void _freeThreadTable(void)
+{
+    pthread_mutex_lock(&_tableLock);
+    for (unsigned chunk = 0; chunk < _chunkWatermark; chunk++) {
+        free(_threadChunks[chunk]);
+        _threadChunks[chunk] = NULL;
+        _chunkUsed[chunk] = 0;
+    }
+    _openChunks = -1;
+    _freeChunkIndices = -1;
+    _chunkWatermark = 0;
+    _spareChunk = -1;
+
+    while (_threadMap != NULL) {
+        ThreadMap *retired = _threadMap->retired;
+        free(_threadMap);
+        _threadMap = retired;
+    }
+    pthread_mutex_unlock(&_tableLock);
+}
 
 /*
  * Adds a new, waiting thread.
@@ -50,121 +542,805 @@ Queue _readyQueue;
  */
 int startThread(int threadId)
 {
-    if (((threadId < 0) || (threadId >= MAX_THREADS) ||
-        (_threads[threadId].state != STATE_UNUSED))) {
+    Thread *thread = _getThread(threadId);
+    if ((thread == NULL) || (thread->state != STATE_UNUSED)) {
         return -1;
     }
 
-    _threads[threadId].threadId = threadId;
-    _threads[threadId].state    = STATE_WAITING;
+    thread->threadId   = threadId;
+    thread->state      = STATE_WAITING;
+    thread->queue      = NULL;
+    thread->runQueue   = NULL;
+    thread->cpu        = -1;
+    thread->level      = 0;
+    thread->boostEpoch = __atomic_load_n(&_boostEpoch, __ATOMIC_RELAXED);
+    thread->vruntime   = 0;
+    thread->weight     = FAIR_DEFAULT_WEIGHT;
+    thread->timerSlot  = -1;
+    thread->timedOut   = 0;
     return 0;
 }
 
 /*
  * Append to the tail of the queue.
- * Does nothing on error.
+ * Does nothing if the thread was not started or is already on a queue.
  */
 void _enqueue(Queue *queue, int data)
 {
-    (void)queue;
-    (void)data;
+    Thread *thread = _findThread(data);
+    if ((thread == NULL) || (thread->queue != NULL)) {
+        return;
+    }
 
-    QueueItem *newNode = (QueueItem*)malloc(sizeof(QueueItem)); // sizeof(int + pointer) casted as a queue item pointer
-    newNode->data = data;
-    newNode->next = NULL;
-    if (queue->head == NULL) {
-        queue->head = newNode;
-        queue->tail = newNode;
+    thread->queue = queue;
+    thread->next  = QUEUE_END;
+    thread->prev  = QUEUE_END;
+
+    if (queue->head == QUEUE_END) {
+        queue->head = data;
+        queue->tail = data;
     }
     else {
-        queue->tail->next = newNode;
-        queue->tail = newNode;
+        thread->prev = queue->tail;
+        _thread(queue->tail)->next = data;
+        queue->tail = data;
     }   
 }
 
+/*
+ * Remove a thread from the queue it is on, wherever it is in the queue.
+ * Does nothing if the thread is not on a queue.
+ */
+void _removeFromQueue(int data)
+{
+    Thread *thread = _thread(data);
+    Queue *queue = thread->queue;
+
+    if (queue == NULL) {
+        return;
+    }
+
+    if (thread->prev == QUEUE_END) {
+        queue->head = thread->next;
+    } else {
+        _thread(thread->prev)->next = thread->next;
+    }
+    if (thread->next == QUEUE_END) {
+        queue->tail = thread->prev;
+    } else {
+        _thread(thread->next)->prev = thread->prev;
+    }
+
+    thread->queue = NULL;
+}
+
 /*
  * Remove and get the head of the queue.
  * Return -1 if the queue is empty.
  */
 int _dequeue(Queue *queue)
 {
-    (void)queue;
-	
-    if (queue->head == NULL) {
+    if (queue->head == QUEUE_END) {
         return -1;
     }
     
-    QueueItem *x = queue->head;
-    queue->head = x->next;
-    int y = x->data;
-    free(x);
+    int y = queue->head;
+    _removeFromQueue(y);
     return y;
 }
 
-void initScheduler()
+/*
+ * Get the MLFQ level of a thread. Threads that were not on a ready queue
+ * during the last boost are moved to level 0 here.
+ */
+static int _getLevel(Thread *thread)
+{
+    const unsigned boostEpoch = __atomic_load_n(&_boostEpoch, __ATOMIC_RELAXED);
+
+    if (thread->boostEpoch != boostEpoch) {
+        thread->boostEpoch = boostEpoch;
+        thread->level = 0;
+    }
+    return thread->level;
+}
+
+static int _heapLess(int a, int b)
 {
-    _readyQueue.head = NULL;
+    if (_thread(a)->vruntime != _thread(b)->vruntime) {
+        return _thread(a)->vruntime < _thread(b)->vruntime;
+    }
+    return a < b;
 }
 
 /*
- * Called whenever a waiting thread gets ready to run.
+ * Meld two heaps. Return the new root.
  */
+static int _heapMeld(int a, int b)
+{
+    if (a == QUEUE_END) {
+        return b;
+    }
+    if (b == QUEUE_END) {
+        return a;
+    }
+    if (_heapLess(b, a)) {
+        const int swap = a;
+        a = b;
+        b = swap;
+    }
 
-void onThreadReady(int threadId)
+    // b becomes the first child of a.
+    _thread(b)->heapNext = _thread(a)->heapChild;
+    _thread(b)->heapPrev = a;
+    if (_thread(a)->heapChild != QUEUE_END) {
+        _thread(_thread(a)->heapChild)->heapPrev = b;
+    }
+    _thread(a)->heapChild = b;
+    return a;
+}
+
+/*
+ * Meld a list of siblings into one heap: first pairwise from the left,
+ * then the results from the right. Return the new root.
+ */
+static int _heapMergePairs(int first)
+{
+    int pairs = QUEUE_END;
+
+    while (first != QUEUE_END) {
+        const int a = first;
+        const int b = _thread(a)->heapNext;
+        first = (b == QUEUE_END) ? QUEUE_END : _thread(b)->heapNext;
+
+        _thread(a)->heapNext = QUEUE_END;
+        _thread(a)->heapPrev = QUEUE_END;
+        if (b != QUEUE_END) {
+            _thread(b)->heapNext = QUEUE_END;
+            _thread(b)->heapPrev = QUEUE_END;
+        }
+
+        // Collect the melded pairs in reverse order.
+        const int pair = _heapMeld(a, b);
+        _thread(pair)->heapNext = pairs;
+        pairs = pair;
+    }
+
+    int root = QUEUE_END;
+    while (pairs != QUEUE_END) {
+        const int pair = pairs;
+        pairs = _thread(pair)->heapNext;
+        _thread(pair)->heapNext = QUEUE_END;
+        root = _heapMeld(root, pair);
+    }
+    return root;
+}
+
+static void _heapInsert(RunQueue *runQueue, int threadId)
+{
+    _thread(threadId)->heapChild = QUEUE_END;
+    _thread(threadId)->heapNext  = QUEUE_END;
+    _thread(threadId)->heapPrev  = QUEUE_END;
+    runQueue->fairRoot = _heapMeld(runQueue->fairRoot, threadId);
+}
+
+static void _heapRemove(RunQueue *runQueue, int threadId)
+{
+    Thread *thread = _thread(threadId);
+    const int children = _heapMergePairs(thread->heapChild);
+
+    if (runQueue->fairRoot == threadId) {
+        runQueue->fairRoot = children;
+        return;
+    }
+
+    // Cut the node out of the sibling list of its parent.
+    if (_thread(thread->heapPrev)->heapChild == threadId) {
+        _thread(thread->heapPrev)->heapChild = thread->heapNext;
+    } else {
+        _thread(thread->heapPrev)->heapNext = thread->heapNext;
+    }
+    if (thread->heapNext != QUEUE_END) {
+        _thread(thread->heapNext)->heapPrev = thread->heapPrev;
+    }
+    runQueue->fairRoot = _heapMeld(runQueue->fairRoot, children);
+}
+
+/*
+ * Charge a thread for the given share of a time slice.
+ */
+static void _chargeThread(Thread *thread, int64_t runtime)
+{
+    thread->vruntime += runtime * FAIR_DEFAULT_WEIGHT / thread->weight;
+}
+
+/*
+ * Put a thread on the ready queue of its level.
+ * Must be called with the lock of the run queue held.
+ */
+static void _makeReady(RunQueue *runQueue, int threadId)
+{
+    Thread *thread = _thread(threadId);
+    if (thread->runQueue != NULL) {
+        return;
+    }
+
+    if (_policy == POLICY_FAIR) {
+        _heapInsert(runQueue, threadId);
+        __atomic_store_n(&thread->runQueue, runQueue, __ATOMIC_RELEASE);
+        __atomic_store_n(&runQueue->readyCount, runQueue->readyCount + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    const int level = (_policy == POLICY_MLFQ) ? _getLevel(thread) : 0;
+
+    _enqueue(&runQueue->levels[level], threadId);
+    __atomic_store_n(&thread->runQueue, runQueue, __ATOMIC_RELEASE);
+    runQueue->levelMap |= 1u << level;
+    __atomic_store_n(&runQueue->readyCount, runQueue->readyCount + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Take a thread off a ready queue.
+ * Must be called with the lock of the run queue held.
+ */
+static void _unlinkReady(RunQueue *runQueue, int threadId)
+{
+    Queue *queue = _thread(threadId)->queue;
+    assert(_thread(threadId)->runQueue == runQueue);
+
+    if (_policy == POLICY_FAIR) {
+        _heapRemove(runQueue, threadId);
+    } else {
+        _removeFromQueue(threadId);
+        if (queue->head == QUEUE_END) {
+            runQueue->levelMap &= ~(1u << (queue - runQueue->levels));
+        }
+    }
+    __atomic_store_n(&_thread(threadId)->runQueue, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&runQueue->readyCount, runQueue->readyCount - 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Take a thread off the ready queues, if it is on one. The thread may be
+ * stolen by another CPU meanwhile, so check again once the lock is held.
+ */
+static void _removeReady(int threadId)
+{
+    for (;;) {
+        RunQueue *runQueue = __atomic_load_n(&_thread(threadId)->runQueue, __ATOMIC_ACQUIRE);
+        if (runQueue == NULL) {
+            return;
+        }
+
+        pthread_mutex_lock(&runQueue->lock);
+        if (_thread(threadId)->runQueue == runQueue) {
+            _unlinkReady(runQueue, threadId);
+            pthread_mutex_unlock(&runQueue->lock);
+            return;
+        }
+        pthread_mutex_unlock(&runQueue->lock);
+    }
+}
+
+/*
+ * Move all threads to level 0. Only the ready threads are moved here, all
+ * others when they get ready again (see _getLevel). The epoch is global, so
+ * this is done for all run queues at once.
+ * Must be called with no run queue lock held.
+ */
+static void _boost(void)
+{
+    __atomic_fetch_add(&_boostEpoch, 1, __ATOMIC_RELAXED);
+
+    for (int cpu = 0; cpu < _cpuCount; cpu++) {
+        RunQueue *runQueue = &_runQueues[cpu];
+
+        pthread_mutex_lock(&runQueue->lock);
+        for (int level = 1; level < MLFQ_LEVELS; level++) {
+            int threadId;
+            while ((threadId = _dequeue(&runQueue->levels[level])) != -1) {
+                _enqueue(&runQueue->levels[0], threadId);
+                _getLevel(_thread(threadId));
+            }
+        }
+        if (runQueue->levelMap != 0) {
+            runQueue->levelMap = 1;
+        }
+        pthread_mutex_unlock(&runQueue->lock);
+    }
+}
+
+/*
+ * Take the first thread of the highest non-empty level, or the thread with
+ * the lowest virtual runtime in fair-share mode.
+ * Return -1 if there is none. Must be called with the lock held.
+ */
+static int _pickNext(RunQueue *runQueue)
+{
+    if (_policy == POLICY_FAIR) {
+        const int threadId = runQueue->fairRoot;
+        if (threadId == QUEUE_END) {
+            return -1;
+        }
+
+        _unlinkReady(runQueue, threadId);
+        if (_thread(threadId)->vruntime > runQueue->minVruntime) {
+            runQueue->minVruntime = _thread(threadId)->vruntime;
+        }
+        return threadId;
+    }
+
+    if (runQueue->levelMap == 0) {
+        return -1;
+    }
+    const int level = __builtin_ctz(runQueue->levelMap);
+    const int threadId = runQueue->levels[level].head;
+
+    _unlinkReady(runQueue, threadId);
+    return threadId;
+}
+
+/*
+ * Take a thread from the CPU with the most ready threads.
+ * Return -1 if no other CPU has a ready thread.
+ */
+static int _steal(int cpu)
+{
+    for (;;) {
+        RunQueue *victim = NULL;
+        int victimReady = 0;
+
+        for (int i = 1; i < _cpuCount; i++) {
+            RunQueue *runQueue = &_runQueues[(cpu + i) % _cpuCount];
+            const int ready = __atomic_load_n(&runQueue->readyCount, __ATOMIC_RELAXED);
+            if (ready > victimReady) {
+                victim = runQueue;
+                victimReady = ready;
+            }
+        }
+        if (victim == NULL) {
+            return -1;
+        }
+
+        pthread_mutex_lock(&victim->lock);
+        const int threadId = _pickNext(victim);
+        if (threadId != -1) {
+            // Make the virtual runtime relative to the new run queue.
+            _thread(threadId)->vruntime -= victim->minVruntime;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        // Someone else was faster, look again.
+        if (threadId != -1) {
+            return threadId;
+        }
+    }
+}
+
+/*
+ * Put a thread on the timer wheel slot for its expiry time: the lowest
+ * level whose range covers the time left.
+ * Must be called with _timerLock held.
+ */
+static void _armTimer(int threadId)
+{
+    Thread *thread = _thread(threadId);
+    const uint64_t delta = thread->timerExpires - _ticks;
+
+    int level = 0;
+    while ((level < TIMER_LEVELS - 1) && (delta >> ((level + 1) * TIMER_BITS)) != 0) {
+        level++;
+    }
+    const int slot = level * TIMER_SLOTS +
+                     (int)((thread->timerExpires >> (level * TIMER_BITS)) & TIMER_MASK);
+
+    thread->timerSlot = slot;
+    thread->timerPrev = QUEUE_END;
+    thread->timerNext = _timerWheel[slot];
+    if (thread->timerNext != QUEUE_END) {
+        _thread(thread->timerNext)->timerPrev = threadId;
+    }
+    _timerWheel[slot] = threadId;
+}
+
+/*
+ * Take a thread off the timer wheel, if it is on it.
+ * Must be called with _timerLock held.
+ */
+static void _cancelTimer(int threadId)
+{
+    Thread *thread = _thread(threadId);
+    if (thread->timerSlot < 0) {
+        return;
+    }
+
+    if (thread->timerPrev == QUEUE_END) {
+        _timerWheel[thread->timerSlot] = thread->timerNext;
+    } else {
+        _thread(thread->timerPrev)->timerNext = thread->timerNext;
+    }
+    if (thread->timerNext != QUEUE_END) {
+        _thread(thread->timerNext)->timerPrev = thread->timerPrev;
+    }
+    thread->timerSlot = -1;
+}
+
+/*
+ * Move the threads of a slot to the lower levels, now that its time came.
+ * Must be called with _timerLock held.
+ */
+static void _cascadeTimers(int slot)
+{
+    int threadId = _timerWheel[slot];
+    _timerWheel[slot] = QUEUE_END;
+
+    while (threadId != QUEUE_END) {
+        const int next = _thread(threadId)->timerNext;
+        _armTimer(threadId);
+        threadId = next;
+    }
+}
+
+/*
+ * Mark a thread ready and queue it (unless it already is).
+ * Must be called with the lock of the run queue held.
+ */
+static void _wakeThread(RunQueue *runQueue, int threadId)
+{
+    Thread *thread = _thread(threadId);
+
+    // Do not let a thread that waited for a long time (or a new one) catch
+    // up on all the CPU time it did not use.
+    if ((_policy == POLICY_FAIR) && (thread->state != STATE_READY) &&
+        (thread->vruntime < runQueue->minVruntime - FAIR_TIME_SLICE)) {
+        thread->vruntime = runQueue->minVruntime - FAIR_TIME_SLICE;
+    }
+
+    thread->state = STATE_READY;
+    _makeReady(runQueue, threadId);
+}
+
+/*
+ * Initialize the scheduler for the given number of CPUs (at most
+ * MAX_CPUS), each with a run queue of its own.
+ */
+void initSchedulerWithCpus(SchedulingPolicy policy, int cpuCount)
+{
+    assert((cpuCount > 0) && (cpuCount <= MAX_CPUS));
+
+    // Forget all threads, so the scheduler can be started again.
+    _freeThreadTable();
+
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        RunQueue *runQueue = &_runQueues[cpu];
+
+        pthread_mutex_init(&runQueue->lock, NULL);
+        for (int level = 0; level < MLFQ_LEVELS; level++) {
+            runQueue->levels[level].head = QUEUE_END;
+            runQueue->levels[level].tail = QUEUE_END;
+        }
+        runQueue->levelMap    = 0;
+        runQueue->fairRoot    = QUEUE_END;
+        runQueue->minVruntime = 0;
+        runQueue->readyCount  = 0;
+    }
+    _cpuCount = cpuCount;
+    _policy = policy;
+    _decisions = 0;
+
+    pthread_mutex_lock(&_timerLock);
+    for (int slot = 0; slot < TIMER_LEVELS * TIMER_SLOTS; slot++) {
+        _timerWheel[slot] = QUEUE_END;
+    }
+    _ticks = 0;
+    pthread_mutex_unlock(&_timerLock);
+}
+
+/*
+ * Initialize the scheduler for a single CPU with the given policy.
+ */
+void initSchedulerWithPolicy(SchedulingPolicy policy)
+{
+    initSchedulerWithCpus(policy, 1);
+}
+
+void initScheduler()
 {
-    (void)threadId;
+    initSchedulerWithPolicy(POLICY_FIFO);
+}
+
+/*
+ * Called whenever a waiting thread gets ready to run. The thread is queued
+ * on the CPU it last ran on, or on the given CPU if it never ran.
+ */
+void onThreadReadyOnCpu(int threadId, int cpu)
+{
+    assert((cpu >= 0) && (cpu < _cpuCount));
+
     // If it is unused, create a new thread
-    if (_threads[threadId].state == STATE_UNUSED) {
-        startThread(threadId);
+    Thread *thread = _findThread(threadId);
+    if ((thread == NULL) || (thread->state == STATE_UNUSED)) {
+        if (startThread(threadId) != 0) {
+            return;
+        }
+        thread = _thread(threadId);
     }
-    // Whereas if it already exists, change the state
-    else {
-       _threads[threadId].state = STATE_READY; 
+    if (thread->cpu >= 0) {
+        cpu = thread->cpu;
     }
-    // Queue it
-    _enqueue(&_readyQueue, threadId);
+
+    // A timed wait ends early.
+    pthread_mutex_lock(&_timerLock);
+    _cancelTimer(threadId);
+    pthread_mutex_unlock(&_timerLock);
+
+    // Change the state and queue it (unless it already is)
+    RunQueue *runQueue = &_runQueues[cpu];
+    pthread_mutex_lock(&runQueue->lock);
+    _wakeThread(runQueue, threadId);
+    pthread_mutex_unlock(&runQueue->lock);
+}
+
+/*
+ * Called whenever a waiting thread gets ready to run.
+ */
+
+void onThreadReady(int threadId)
+{
+    onThreadReadyOnCpu(threadId, 0);
 }
 
 /*
  * Called whenever a running thread is forced of the CPU
  * (e.g., through a timer interrupt).
+ * Does nothing if the thread was not started.
  */
 void onThreadPreempted(int threadId)
 {
-    (void)threadId;
-	
-    _threads[threadId].state = STATE_READY;
-    _enqueue(&_readyQueue, threadId);
+    Thread *thread = _findThread(threadId);
+    if ((thread == NULL) || (thread->state == STATE_UNUSED)) {
+        return;
+    }
+
+    // Used up its time slice: lower its priority.
+    if (_policy == POLICY_MLFQ) {
+        if (_getLevel(thread) < MLFQ_LEVELS - 1) {
+            thread->level++;
+        }
+    } else if (_policy == POLICY_FAIR) {
+        _chargeThread(thread, FAIR_TIME_SLICE);
+    }
+
+    // It stays on the CPU it ran on.
+    RunQueue *runQueue = &_runQueues[(thread->cpu >= 0) ? thread->cpu : 0];
+    pthread_mutex_lock(&runQueue->lock);
+    thread->state = STATE_READY;
+    _makeReady(runQueue, threadId);
+    pthread_mutex_unlock(&runQueue->lock);
 }
 
 /*
  * Called whenever a running thread needs to wait.
+ * Does nothing if the thread was not started.
  */
 
 void onThreadWaiting(int threadId)
 {
-    (void)threadId;
-    _threads[threadId].state = STATE_WAITING;
+    Thread *thread = _findThread(threadId);
+    if ((thread == NULL) || (thread->state == STATE_UNUSED)) {
+        return;
+    }
+
+    // A waiting thread must not be selected by the scheduler.
+    _removeReady(threadId);
+
+    // Gave up the CPU before its time slice ended: raise its priority.
+    if (_policy == POLICY_MLFQ) {
+        if (_getLevel(thread) > 0) {
+            thread->level--;
+        }
+    } else if ((_policy == POLICY_FAIR) && (thread->state == STATE_RUNNING)) {
+        _chargeThread(thread, FAIR_TIME_SLICE / 2);
+    }
+
+    thread->state = STATE_WAITING;
 }
 
 /*
- * Gets the id of the next thread to run and sets its state to running.
+ * Called when a thread ends. Its ID may be used by a new thread afterwards.
  */
-int scheduleNextThread()
+void onThreadExit(int threadId)
 {
-    // Check if the queue is empty + set the thread to running state
-    int threadIdNumber = _dequeue(&_readyQueue);
-    if (threadIdNumber ==  -1) {
-        return -1;
+    Thread *thread = _findThread(threadId);
+    if ((thread == NULL) || (thread->state == STATE_UNUSED)) {
+        return;
     }
-    _threads[threadIdNumber].state = STATE_RUNNING;
+
+    _removeReady(threadId);
+    pthread_mutex_lock(&_timerLock);
+    _cancelTimer(threadId);
+    pthread_mutex_unlock(&_timerLock);
+    thread->state = STATE_UNUSED;
+    _releaseThread(threadId);
+}
+
+/*
+ * Called whenever a running thread needs to wait for at most the given
+ * number of ticks. If onThreadReady is not called before, the thread gets
+ * ready on the tick the time is up and hasTimedOut returns 1.
+ * Does nothing if the thread was not started.
+ */
+void onThreadWaitingFor(int threadId, unsigned ticks)
+{
+    Thread *thread = _findThread(threadId);
+    if ((thread == NULL) || (thread->state == STATE_UNUSED)) {
+        return;
+    }
+
+    onThreadWaiting(threadId);
+
+    pthread_mutex_lock(&_timerLock);
+    _cancelTimer(threadId);
+    thread->timedOut = 0;
+    if (ticks > 0) {
+        thread->timerExpires = _ticks + ticks;
+        _armTimer(threadId);
+        pthread_mutex_unlock(&_timerLock);
+        return;
+    }
+    thread->timedOut = 1;
+    pthread_mutex_unlock(&_timerLock);
+
+    onThreadReady(threadId);
+}
+
+/*
+ * Called whenever a running thread goes to sleep for the given number of
+ * ticks. This is a timed wait that nothing else ends.
+ */
+void onThreadSleep(int threadId, unsigned ticks)
+{
+    onThreadWaitingFor(threadId, ticks);
+}
+
+/*
+ * Return 1 if the last timed wait of the thread ended because the time
+ * was up, 0 if it was ended by onThreadReady.
+ */
+int hasTimedOut(int threadId)
+{
+    Thread *thread = _findThread(threadId);
+    if (thread == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&_timerLock);
+    const int timedOut = thread->timedOut;
+    pthread_mutex_unlock(&_timerLock);
+    return timedOut;
+}
+
+/*
+ * Called on every timer interrupt. Advances the clock by one tick and makes
+ * all threads whose timed wait is over ready, taking the lock of a run
+ * queue once for a run of threads that go to the same CPU.
+ */
+void onTimerTick()
+{
+    pthread_mutex_lock(&_timerLock);
+    const uint64_t now = ++_ticks;
+
+    // Whenever the slot index of a level wraps around, the next slot of the
+    // level above is due.
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+        if (((now >> ((level - 1) * TIMER_BITS)) & TIMER_MASK) != 0) {
+            break;
+        }
+        _cascadeTimers(level * TIMER_SLOTS + (int)((now >> (level * TIMER_BITS)) & TIMER_MASK));
+    }
+
+    // Detach the expired threads. _timerLock stays held, so none of them
+    // can be put on the wheel again before it is ready.
+    const int slot = (int)(now & TIMER_MASK);
+    int expired = _timerWheel[slot];
+    _timerWheel[slot] = QUEUE_END;
+
+    RunQueue *locked = NULL;
+    while (expired != QUEUE_END) {
+        const int threadId = expired;
+        Thread *thread = _thread(threadId);
+        expired = thread->timerNext;
+        thread->timerSlot = -1;
+        thread->timedOut  = 1;
+
+        const int cpu = (thread->cpu >= 0) ? thread->cpu : 0;
+        RunQueue *runQueue = &_runQueues[cpu];
+        if (runQueue != locked) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&runQueue->lock);
+            locked = runQueue;
+        }
+        _wakeThread(runQueue, threadId);
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    pthread_mutex_unlock(&_timerLock);
+}
+
+/*
+ * Gets the id of the next thread to run on the given CPU and sets its state
+ * to running. If the CPU has no ready thread it steals one from another CPU.
+ */
+int scheduleNextThreadOnCpu(int cpu)
+{
+    assert((cpu >= 0) && (cpu < _cpuCount));
+
+    RunQueue *runQueue = &_runQueues[cpu];
+
+    if ((_policy == POLICY_MLFQ) &&
+        (__atomic_add_fetch(&_decisions, 1, __ATOMIC_RELAXED) % (MLFQ_BOOST_INTERVAL * (unsigned)_cpuCount) == 0)) {
+        _boost();
+    }
+
+    // Check if the queues are empty, otherwise take the first thread of
+    // the highest non-empty level + set the thread to running state
+    pthread_mutex_lock(&runQueue->lock);
+    int threadIdNumber = _pickNext(runQueue);
+    pthread_mutex_unlock(&runQueue->lock);
+
+    if (threadIdNumber == -1) {
+        threadIdNumber = _steal(cpu);
+        if (threadIdNumber == -1) {
+            return -1;
+        }
+
+        pthread_mutex_lock(&runQueue->lock);
+        _thread(threadIdNumber)->vruntime += runQueue->minVruntime;
+        pthread_mutex_unlock(&runQueue->lock);
+    }
+
+    _thread(threadIdNumber)->cpu   = cpu;
+    _thread(threadIdNumber)->state = STATE_RUNNING;
     return threadIdNumber;
 }
 
+/*
+ * Set the share of CPU time a thread gets in fair-share mode, relative to
+ * FAIR_DEFAULT_WEIGHT. Return -1 if the thread does not exist.
+ */
+int setThreadWeight(int threadId, unsigned weight)
+{
+    Thread *thread = _findThread(threadId);
+    if ((thread == NULL) || (thread->state == STATE_UNUSED) || (weight == 0)) {
+        return -1;
+    }
+
+    thread->weight = weight;
+    return 0;
+}
+
+/*
+ * Gets the id of the next thread to run and sets its state to running.
+ */
+int scheduleNextThread()
+{
+    return scheduleNextThreadOnCpu(0);
+}
+
+/*
+ * Build with -DSCHEDULER_NO_MAIN to link the scheduler into another
+ * program (see sched_replay.c).
+ */
+#ifndef SCHEDULER_NO_MAIN
 int main() {
-	// Initially empty queue (head and tail is NULL)
-	Queue q = {NULL,NULL};
+	// Initially empty queue
+	Queue q = {QUEUE_END,QUEUE_END};
 
+	startThread( 42 );
+	startThread( 99 );
 	_enqueue( &q, 42 );
 	_enqueue( &q, 99 );
 	int x = _dequeue( &q );
@@ -173,3 +1349,4 @@ int main() {
 	x = _dequeue( &q );
 	printf("Expect: 99, and I got: %d\n", x);
 }
+#endif
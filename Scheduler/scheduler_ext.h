@@ -0,0 +1,40 @@
+#pragma once
+#include "scheduler.h"
+
+/*
+ * The scheduler functions beyond the single-CPU FIFO interface.
+ */
+
+/*
+ * Maximum number of CPUs, each with a run queue of its own.
+ */
+#define MAX_CPUS 64
+
+typedef enum _SchedulingPolicy {
+    POLICY_FIFO = 0, // One queue, threads run in the order they got ready
+    POLICY_MLFQ,     // Preempted threads lose priority, waiting threads gain it
+    POLICY_FAIR      // The thread with the lowest weighted runtime runs next
+} SchedulingPolicy;
+
+void initSchedulerWithPolicy(SchedulingPolicy policy);
+/*
+ * cpuCount must be between 1 and MAX_CPUS.
+ */
+void initSchedulerWithCpus(SchedulingPolicy policy, int cpuCount);
+
+void onThreadReadyOnCpu(int threadId, int cpu);
+int scheduleNextThreadOnCpu(int cpu);
+
+/*
+ * Timed waits, driven by onTimerTick.
+ */
+void onThreadWaitingFor(int threadId, unsigned ticks);
+void onThreadSleep(int threadId, unsigned ticks);
+int hasTimedOut(int threadId);
+void onTimerTick();
+
+/*
+ * Return -1 if the thread does not exist or the weight is 0.
+ */
+int setThreadWeight(int threadId, unsigned weight);
+void onThreadExit(int threadId);